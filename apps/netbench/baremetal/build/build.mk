@@ -0,0 +1,8 @@
+MYDIR := $(dir $(lastword $(MAKEFILE_LIST)))
+
+EBBRT_TARGET := netbench
+EBBRT_APP_OBJECTS := netbench.o
+EBBRT_APP_VPATH := $(abspath $(MYDIR)../src)
+EBBRT_CONFIG := $(abspath $(MYDIR)../src/ebbrtcfg.h)
+
+include $(abspath ../../../../ebbrtbaremetal.mk)
@@ -0,0 +1,14 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef APPS_NETBENCH_BAREMETAL_SRC_EBBRTCFG_H_
+#define APPS_NETBENCH_BAREMETAL_SRC_EBBRTCFG_H_
+
+#define __EBBRT_ENABLE_FDT__ 0
+#define __EBBRT_ENABLE_DISTRIBUTED_RUNTIME__ 0
+#define __EBBRT_ENABLE_NETWORKING__ 1
+#define __EBBRT_ENABLE_LOOPBACK_NETWORK__ 1
+#define LARGE_WINDOW_HACK 1
+
+#endif  // APPS_NETBENCH_BAREMETAL_SRC_EBBRTCFG_H_
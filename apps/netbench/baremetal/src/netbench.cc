@@ -0,0 +1,354 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Measures the network stack against itself over a LoopbackNetDevice: udp
+// throughput, tcp throughput and tcp rpc latency, all on one core and without
+// a nic. Each test is run for every device profile below. The clone and
+// destroy costs of the shared buffer references the stack uses are measured
+// first.
+#include <algorithm>
+#include <vector>
+
+#include <ebbrt/Clock.h>
+#include <ebbrt/Cpu.h>
+#include <ebbrt/Debug.h>
+#include <ebbrt/EventManager.h>
+#include <ebbrt/LocalSharedIOBufRef.h>
+#include <ebbrt/LoopbackNet.h>
+#include <ebbrt/NetTcpHandler.h>
+#include <ebbrt/SharedIOBufRef.h>
+#include <ebbrt/StaticIOBuf.h>
+#include <ebbrt/UniqueIOBuf.h>
+
+namespace {
+const constexpr uint16_t kUdpPort = 5001;
+const constexpr uint16_t kStreamPort = 5002;
+const constexpr uint16_t kRpcPort = 5003;
+
+const constexpr size_t kUdpDatagrams = 200000;
+const constexpr size_t kUdpSize = 1024;
+// datagrams sent before letting the receiver catch up
+const constexpr size_t kUdpBurst = 32;
+const constexpr size_t kStreamChunk = 64 * 1024;
+const constexpr size_t kRpcIterations = 20000;
+const constexpr size_t kRpcSize = 64;
+const constexpr size_t kRefIterations = 1000000;
+// references held at once, as for the segments of a tcp send
+const constexpr size_t kRefBatch = 64;
+
+struct Profile {
+  const char* name;
+  ebbrt::LoopbackNetDevice::Config config;
+  size_t stream_bytes;
+};
+
+std::vector<Profile> Profiles() {
+  std::vector<Profile> profiles;
+  profiles.push_back({"ideal", ebbrt::LoopbackNetDevice::Config(), 1 << 28});
+  // The stack has no fast retransmit, every tcp loss costs a retransmit
+  // timeout, so the lossy stream is kept short
+  ebbrt::LoopbackNetDevice::Config lossy;
+  lossy.latency = std::chrono::microseconds(20);
+  lossy.loss = 0.0001;
+  lossy.reorder = 0.001;
+  lossy.csum_offload = false;
+  profiles.push_back({"lossy", lossy, 1 << 26});
+  return profiles;
+}
+
+// Data sent by every test, the stack only ever reads it
+uint8_t payload[kStreamChunk];
+
+ebbrt::LoopbackNetDevice* device;
+ebbrt::Ipv4Address address;
+ebbrt::EventManager::EventContext context;
+
+// Block the benchmark until Resume() is called from a callback
+void Wait() { ebbrt::event_manager->SaveContext(context); }
+void Resume() { ebbrt::event_manager->ActivateContext(std::move(context)); }
+
+// Let everything already spawned, such as packet deliveries, run first
+void Yield() {
+  ebbrt::event_manager->SpawnLocal([]() { Resume(); },
+                                   /* force_async = */ true);
+  Wait();
+}
+
+double Seconds(ebbrt::clock::Wall::time_point since) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      ebbrt::clock::Wall::Now() - since);
+  return static_cast<double>(ns.count()) / 1000000000.0;
+}
+
+std::unique_ptr<ebbrt::IOBuf> Payload(size_t len) {
+  return ebbrt::IOBuf::Create<ebbrt::StaticIOBuf>(payload, len);
+}
+
+double NsPer(ebbrt::clock::Wall::time_point since, size_t n) {
+  return Seconds(since) * 1000000000.0 / n;
+}
+
+// Clone and destroy a reference to base, one at a time and in batches on
+// this core, then with the batch destroyed on another core
+template <typename Ref> void RefCosts(const char* name) {
+  auto base = ebbrt::IOBuf::Create<Ref>(ebbrt::MakeUniqueIOBuf(kRpcSize));
+  auto start = ebbrt::clock::Wall::Now();
+  for (size_t i = 0; i < kRefIterations; ++i) {
+    auto clone = ebbrt::IOBuf::Create<Ref>(Ref::CloneView, *base);
+  }
+  auto single = NsPer(start, kRefIterations);
+
+  std::vector<std::unique_ptr<Ref>> held;
+  held.reserve(kRefBatch);
+  start = ebbrt::clock::Wall::Now();
+  for (size_t i = 0; i < kRefIterations / kRefBatch; ++i) {
+    for (size_t j = 0; j < kRefBatch; ++j) {
+      held.emplace_back(ebbrt::IOBuf::Create<Ref>(Ref::CloneView, *base));
+    }
+    held.clear();
+  }
+  auto batched = NsPer(start, kRefIterations / kRefBatch * kRefBatch);
+  ebbrt::kprintf("  %s: clone+destroy %.1lf ns, batched %.1lf ns", name,
+                 single, batched);
+
+  if (ebbrt::Cpu::Count() < 2) {
+    ebbrt::kprintf("\n");
+    return;
+  }
+  for (size_t j = 0; j < kRefBatch; ++j) {
+    held.emplace_back(ebbrt::IOBuf::Create<Ref>(Ref::CloneView, *base));
+  }
+  size_t mine = ebbrt::Cpu::GetMine();
+  double remote;
+  ebbrt::event_manager->SpawnRemote(
+      [&held, &remote, mine]() {
+        auto start = ebbrt::clock::Wall::Now();
+        held.clear();
+        remote = NsPer(start, kRefBatch);
+        ebbrt::event_manager->SpawnRemote([]() { Resume(); }, mine);
+      },
+      (mine + 1) % ebbrt::Cpu::Count());
+  Wait();
+  // Let a merge the remote destroys asked for run before base goes away
+  Yield();
+  ebbrt::kprintf(", remote destroy %.1lf ns\n", remote);
+}
+
+void RefBench() {
+  ebbrt::kprintf("buffer references:\n");
+  RefCosts<ebbrt::MutSharedIOBufRef>("shared");
+  RefCosts<ebbrt::MutLocalSharedIOBufRef>("local shared");
+}
+
+ebbrt::NetworkManager::UdpPcb udp_server;
+ebbrt::NetworkManager::UdpPcb udp_client;
+size_t udp_received;
+
+void UdpThroughput() {
+  udp_received = 0;
+  auto dropped = device->GetStats().dropped;
+  auto start = ebbrt::clock::Wall::Now();
+  for (size_t sent = 0; sent < kUdpDatagrams; sent += kUdpBurst) {
+    for (size_t i = 0; i < kUdpBurst; ++i) {
+      udp_client.SendTo(address, kUdpPort, Payload(kUdpSize));
+    }
+    Yield();
+  }
+  while (udp_received + device->GetStats().dropped - dropped < kUdpDatagrams) {
+    Yield();
+  }
+  auto secs = Seconds(start);
+  ebbrt::kprintf("  udp: %zu x %zu bytes, %zu received, %.2lf Mbps\n",
+                 kUdpDatagrams, kUdpSize, udp_received,
+                 udp_received * kUdpSize * 8 / secs / 1000000.0);
+}
+
+// Counts the bytes of the stream and resumes the benchmark at the end
+class StreamSink : public ebbrt::TcpHandler {
+ public:
+  explicit StreamSink(ebbrt::NetworkManager::TcpPcb pcb)
+      : ebbrt::TcpHandler(std::move(pcb)) {}
+
+  void Receive(std::unique_ptr<ebbrt::MutIOBuf> buf) override {
+    received_ += buf->ComputeChainDataLength();
+    if (received_ == expected)
+      Resume();
+  }
+  void Close() override { Shutdown(); }
+  void Abort() override {}
+
+  static size_t expected;
+
+ private:
+  size_t received_{0};
+};
+size_t StreamSink::expected;
+
+// Echoes every request straight back
+class RpcServer : public ebbrt::TcpHandler {
+ public:
+  explicit RpcServer(ebbrt::NetworkManager::TcpPcb pcb)
+      : ebbrt::TcpHandler(std::move(pcb)) {}
+
+  void Receive(std::unique_ptr<ebbrt::MutIOBuf> buf) override {
+    Send(std::move(buf));
+    Pcb().Output();
+  }
+  void Close() override { Shutdown(); }
+  void Abort() override {}
+};
+
+// Client side of the stream and rpc tests
+class Client : public ebbrt::TcpHandler {
+ public:
+  explicit Client(ebbrt::NetworkManager::TcpPcb pcb)
+      : ebbrt::TcpHandler(std::move(pcb)) {}
+
+  void Connected() override { Resume(); }
+
+  // Issue iterations requests one after the other, recording their round trip
+  // times
+  void StartRpc(size_t iterations) {
+    remaining_ = iterations;
+    samples_.clear();
+    samples_.reserve(iterations);
+    SendRequest();
+  }
+
+  void Receive(std::unique_ptr<ebbrt::MutIOBuf> buf) override {
+    pending_ -= buf->ComputeChainDataLength();
+    if (pending_ > 0)
+      return;
+
+    samples_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           ebbrt::clock::Wall::Now() - sent_)
+                           .count());
+    if (--remaining_ == 0) {
+      Resume();
+      return;
+    }
+    SendRequest();
+  }
+  void Close() override { Shutdown(); }
+  void Abort() override {}
+
+  std::vector<uint64_t>& Samples() { return samples_; }
+
+ private:
+  void SendRequest() {
+    pending_ = kRpcSize;
+    sent_ = ebbrt::clock::Wall::Now();
+    Send(Payload(kRpcSize));
+    Pcb().Output();
+  }
+
+  size_t remaining_{0};
+  int64_t pending_{0};
+  ebbrt::clock::Wall::time_point sent_;
+  std::vector<uint64_t> samples_;
+};
+
+ebbrt::NetworkManager::ListeningTcpPcb stream_listener;
+ebbrt::NetworkManager::ListeningTcpPcb rpc_listener;
+
+Client* Connect(uint16_t port) {
+  ebbrt::NetworkManager::TcpPcb pcb;
+  pcb.Connect(address, port);
+  auto client = new Client(std::move(pcb));
+  client->Install();
+  Wait();
+  return client;
+}
+
+void TcpThroughput(size_t bytes) {
+  auto client = Connect(kStreamPort);
+  StreamSink::expected = bytes;
+  // The stream is one chain referring to the same data over and over
+  std::unique_ptr<ebbrt::IOBuf> chain;
+  for (size_t i = 0; i < bytes / kStreamChunk; ++i) {
+    if (chain) {
+      chain->PrependChain(Payload(kStreamChunk));
+    } else {
+      chain = Payload(kStreamChunk);
+    }
+  }
+  auto start = ebbrt::clock::Wall::Now();
+  client->Send(std::move(chain));
+  client->Pcb().Output();
+  Wait();
+  auto secs = Seconds(start);
+  ebbrt::kprintf("  tcp stream: %zu bytes, %.2lf Mbps\n", bytes,
+                 bytes * 8 / secs / 1000000.0);
+  client->Shutdown();
+}
+
+void TcpRpc() {
+  auto client = Connect(kRpcPort);
+  client->StartRpc(kRpcIterations);
+  Wait();
+  auto& samples = client->Samples();
+  std::sort(samples.begin(), samples.end());
+  uint64_t total = 0;
+  for (auto s : samples) {
+    total += s;
+  }
+  ebbrt::kprintf("  tcp rpc: %zu x %zu bytes, mean %.2lf us, min %.2lf us, "
+                 "p50 %.2lf us, p99 %.2lf us\n",
+                 samples.size(), kRpcSize,
+                 static_cast<double>(total) / samples.size() / 1000.0,
+                 samples.front() / 1000.0,
+                 samples[samples.size() / 2] / 1000.0,
+                 samples[samples.size() * 99 / 100] / 1000.0);
+  client->Shutdown();
+}
+
+void Run() {
+  RefBench();
+  for (auto& profile : Profiles()) {
+    auto& c = profile.config;
+    device->SetConfig(c);
+    ebbrt::kprintf("%s: latency %lld us, loss %.4lf, reorder %.4lf, csum %s\n",
+                   profile.name, static_cast<long long>(c.latency.count()),
+                   c.loss, c.reorder, c.csum_offload ? "offload" : "device");
+    auto before = device->GetStats();
+    UdpThroughput();
+    TcpThroughput(profile.stream_bytes);
+    TcpRpc();
+    auto after = device->GetStats();
+    ebbrt::kprintf("  device: %llu packets, %llu gso, %llu csums, %llu "
+                   "dropped, %llu reordered\n",
+                   static_cast<unsigned long long>(after.packets -
+                                                   before.packets),
+                   static_cast<unsigned long long>(after.gso_packets -
+                                                   before.gso_packets),
+                   static_cast<unsigned long long>(after.csums - before.csums),
+                   static_cast<unsigned long long>(after.dropped -
+                                                   before.dropped),
+                   static_cast<unsigned long long>(after.reordered -
+                                                   before.reordered));
+  }
+  ebbrt::kprintf("Netbench complete\n");
+}
+}  // namespace
+
+void AppMain() {
+  address = ebbrt::Ipv4Address({127, 0, 0, 1});
+  device = new ebbrt::LoopbackNetDevice(address);
+
+  udp_server.Bind(kUdpPort);
+  udp_server.Receive([](ebbrt::Ipv4Address from, uint16_t port,
+                        std::unique_ptr<ebbrt::MutIOBuf> buf) {
+    ++udp_received;
+  });
+  udp_client.Bind(0);
+  stream_listener.Bind(kStreamPort, [](ebbrt::NetworkManager::TcpPcb pcb) {
+    (new StreamSink(std::move(pcb)))->Install();
+  });
+  rpc_listener.Bind(kRpcPort, [](ebbrt::NetworkManager::TcpPcb pcb) {
+    (new RpcServer(std::move(pcb)))->Install();
+  });
+
+  ebbrt::event_manager->Spawn([]() { Run(); }, /* force_async = */ true);
+}
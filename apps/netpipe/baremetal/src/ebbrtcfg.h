@@ -9,7 +9,6 @@
 #define __EBBRT_ENABLE_DISTRIBUTED_RUNTIME__ 0
 #define __EBBRT_ENABLE_NETWORKING__ 1
 #define LARGE_WINDOW_HACK 1
-#define VIRTIO_ZERO_COPY 1
 #define VIRTIO_NET_POLL 1
 
 #endif  // APPS_NETPIPE_BAREMETAL_SRC_EBBRTCFG_H_
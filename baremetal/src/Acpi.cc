@@ -188,6 +188,15 @@ void ParseSrat(const ACPI_TABLE_SRAT* srat) {
     }
   }
 }
+
+void ParseSlit(const ACPI_TABLE_SLIT* slit) {
+  auto count = slit->LocalityCount;
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < count; ++j) {
+      ebbrt::numa::SetPxmDistance(i, j, slit->Entry[i * count + j]);
+    }
+  }
+}
 }  // namespace
 
 void ebbrt::acpi::PowerOff() {
@@ -232,6 +241,12 @@ void ebbrt::acpi::BootInit() {
     });
   } else {
     ParseSrat(reinterpret_cast<ACPI_TABLE_SRAT*>(srat));
+
+    ACPI_TABLE_HEADER* slit;
+    status = AcpiGetTable(const_cast<char*>(ACPI_SIG_SLIT), 1, &slit);
+    if (ACPI_SUCCESS(status)) {
+      ParseSlit(reinterpret_cast<ACPI_TABLE_SLIT*>(slit));
+    }
   }
 }
 
@@ -4,10 +4,17 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 #include <ebbrt/Cpu.h>
 
+#include <ebbrt/CpuAsm.h>
+#include <ebbrt/Cpuid.h>
 #include <ebbrt/ExplicitlyConstructed.h>
 #include <ebbrt/PageAllocator.h>
 
 namespace {
+const constexpr uintptr_t kCr4OsXsave = 1 << 18;
+const constexpr uint64_t kXcr0X87 = 1 << 0;
+const constexpr uint64_t kXcr0Sse = 1 << 1;
+const constexpr uint64_t kXcr0Avx = 1 << 2;
+
 ebbrt::ExplicitlyConstructed<
     boost::container::static_vector<ebbrt::Cpu, ebbrt::Cpu::kMaxCpus>>
     cpus;
@@ -35,6 +42,14 @@ void ebbrt::Cpu::Init() {
   atss_.tss.SetIstEntry(1, interrupt_stack);
   gdt_.Load();
   idt::Load();
+
+  // Allow avx instructions (e.g. for checksums). Interrupts only save the sse
+  // state, which is enough as they are only taken between events when no
+  // vector state is live.
+  if (cpuid::features.avx) {
+    WriteCr4(ReadCr4() | kCr4OsXsave);
+    WriteXcr(0, ReadXcr(0) | kXcr0X87 | kXcr0Sse | kXcr0Avx);
+  }
 }
 
 void ebbrt::Cpu::SetEventStack(uintptr_t top_of_stack) {
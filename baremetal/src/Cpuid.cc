@@ -29,16 +29,21 @@ CpuidBit cpuid_bits[] = {
     {1, 2, 21, &ebbrt::cpuid::Features::x2apic},
     {0x40000001, 0, 6, &ebbrt::cpuid::Features::kvm_pv_eoi, &kvm_vendor_id},
     {0x40000001, 0, 3, &ebbrt::cpuid::Features::kvm_clocksource2,
-     &kvm_vendor_id}};
+     &kvm_vendor_id},
+    {1, 2, 26, &ebbrt::cpuid::Features::xsave},
+    {1, 2, 28, &ebbrt::cpuid::Features::avx},
+    {7, 1, 5, &ebbrt::cpuid::Features::avx2}};
 
 constexpr size_t nr_cpuid_bits = sizeof(cpuid_bits) / sizeof(CpuidBit);
 }  // namespace
 
 ebbrt::cpuid::Features ebbrt::cpuid::features;
 
-ebbrt::cpuid::Result ebbrt::cpuid::Cpuid(uint32_t leaf) {
+ebbrt::cpuid::Result ebbrt::cpuid::Cpuid(uint32_t leaf, uint32_t subleaf) {
   Result r;
-  asm("cpuid" : "=a"(r.eax), "=b"(r.ebx), "=c"(r.ecx), "=d"(r.edx) : "a"(leaf));
+  asm("cpuid"
+      : "=a"(r.eax), "=b"(r.ebx), "=c"(r.ecx), "=d"(r.edx)
+      : "a"(leaf), "c"(subleaf));
   return r;
 }
 
@@ -65,4 +70,12 @@ void ebbrt::cpuid::Init() {
     uint32_t val = res_array[bit.reg];
     features.*(bit.flag) = (val >> bit.bit) & 1;
   }
+
+  // The avx register state can only be enabled through xsave, see Cpu::Init()
+  if (!features.xsave) {
+    features.avx = false;
+  }
+  if (!features.avx) {
+    features.avx2 = false;
+  }
 }
@@ -0,0 +1,44 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#include <ebbrt/EventArena.h>
+
+#include <algorithm>
+#include <new>
+
+#include <ebbrt/EventManager.h>
+#include <ebbrt/GeneralPurposeAllocator.h>
+
+void* ebbrt::EventArena::AllocSlow(size_t size, size_t align) {
+  // Allocations too large for a chunk get a chunk of their own
+  auto chunk_size = std::max(kChunkSize, sizeof(Chunk) + align + size);
+  auto chunk = static_cast<Chunk*>(gp_allocator->Alloc(chunk_size));
+  if (chunk == nullptr)
+    throw std::bad_alloc();
+
+  auto chunk_addr = reinterpret_cast<uintptr_t>(chunk);
+  chunk->next = head_;
+  chunk->end = chunk_addr + chunk_size;
+  head_ = chunk;
+
+  auto ret = align::Up(chunk_addr + sizeof(Chunk), align);
+  cur_ = ret + size;
+  end_ = chunk->end;
+  return reinterpret_cast<void*>(ret);
+}
+
+void ebbrt::EventArena::Rewind(const Mark& mark) {
+  while (head_ != mark.chunk_) {
+    kassert(head_ != nullptr);
+    auto next = head_->next;
+    gp_allocator->Free(head_);
+    head_ = next;
+  }
+  cur_ = mark.cur_;
+  end_ = head_ == nullptr ? 0 : head_->end;
+}
+
+void ebbrt::EventArena::Release() { Rewind(Mark(nullptr, 0)); }
+
+ebbrt::EventArena& ebbrt::GetEventArena() { return event_manager->GetArena(); }
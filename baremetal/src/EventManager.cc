@@ -120,6 +120,10 @@ template <typename F> void ebbrt::EventManager::InvokeFunction(F&& f) {
     ++generation_count_[generation % 2];
     f();
     --generation_count_[generation % 2];
+    // The event is complete (if it blocked, this is the context it was resumed
+    // in) so its arena allocations can all go
+    if (active_event_context_.arena)
+      active_event_context_.arena->Release();
   } catch (std::exception& e) {
     ebbrt::kabort("Unhandled exception caught: %s\n", e.what());
   } catch (...) {
@@ -347,14 +351,20 @@ uint32_t ebbrt::EventManager::GetEventId() {
   return active_event_context_.event_id;
 }
 
-std::unordered_map<__gthread_key_t, void*>& ebbrt::EventManager::GetTlsMap() {
+ebbrt::EventManager::TlsMap& ebbrt::EventManager::GetTlsMap() {
   if (unlikely(!active_event_context_.tls)) {
-    active_event_context_.tls.reset(
-        new std::unordered_map<__gthread_key_t, void*>());
+    active_event_context_.tls.reset(new TlsMap());
   }
   return *active_event_context_.tls;
 }
 
+ebbrt::EventArena& ebbrt::EventManager::GetArena() {
+  if (unlikely(!active_event_context_.arena)) {
+    active_event_context_.arena.reset(new EventArena());
+  }
+  return *active_event_context_.arena;
+}
+
 void ebbrt::EventManager::IdleCallback::Start() {
   if (!started_) {
     kbugon(event_manager->idle_callback_ != nullptr,
@@ -0,0 +1,138 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#include <ebbrt/LocalSharedIOBufRef.h>
+
+#include <ebbrt/Compiler.h>
+#include <ebbrt/Cpu.h>
+#include <ebbrt/Debug.h>
+#include <ebbrt/EventManager.h>
+
+const constexpr ebbrt::LocalSharedIOBufRefOwner::CloneView_s
+    ebbrt::LocalSharedIOBufRefOwner::CloneView;
+
+ebbrt::LocalSharedIOBufRefOwner::Control::Control(std::unique_ptr<IOBuf>&& b,
+                                                  size_t cpu)
+    : buf(std::move(b)), owner(cpu) {}
+
+void ebbrt::LocalSharedIOBufRefOwner::Control::Acquire() {
+  if (likely(Cpu::GetMine() == owner && !merged)) {
+    ++biased;
+    return;
+  }
+  shared.fetch_add(kOne, std::memory_order_relaxed);
+}
+
+void ebbrt::LocalSharedIOBufRefOwner::Control::Release() {
+  if (likely(Cpu::GetMine() == owner && !merged)) {
+    if (--biased > 0)
+      return;
+
+    // No more references counted on the owner, from here on the shared count
+    // is the only one. If a merge is queued it will do the cleanup.
+    merged = true;
+    auto old = shared.fetch_or(kMerged, std::memory_order_acq_rel);
+    if (old == 0)
+      delete this;
+    return;
+  }
+  ReleaseShared();
+}
+
+void ebbrt::LocalSharedIOBufRefOwner::Control::ReleaseShared() {
+  auto old = shared.load(std::memory_order_relaxed);
+  int64_t val;
+  do {
+    val = old - kOne;
+    // A negative count means a reference counted by the owner was dropped
+    // here, the count cannot reach zero until the owner merges its count
+    if (!(val & kMerged) && val < 0)
+      val |= kQueued;
+  } while (!shared.compare_exchange_weak(old, val, std::memory_order_acq_rel,
+                                         std::memory_order_relaxed));
+
+  if ((val & kQueued) && !(old & kQueued)) {
+    event_manager->SpawnRemote([this]() { Merge(); }, owner);
+  } else if (val == kMerged) {
+    delete this;
+  }
+}
+
+void ebbrt::LocalSharedIOBufRefOwner::Control::Merge() {
+  kassert(Cpu::GetMine() == owner);
+  auto count = static_cast<int64_t>(biased) * kOne;
+  biased = 0;
+  merged = true;
+
+  auto old = shared.load(std::memory_order_relaxed);
+  int64_t val;
+  do {
+    val = ((old + count) | kMerged) & ~kQueued;
+  } while (!shared.compare_exchange_weak(old, val, std::memory_order_acq_rel,
+                                         std::memory_order_relaxed));
+
+  if (val == kMerged)
+    delete this;
+}
+
+ebbrt::LocalSharedIOBufRefOwner::LocalSharedIOBufRefOwner(
+    std::unique_ptr<IOBuf>&& buf)
+    : control_(new Control(std::move(buf), Cpu::GetMine())) {}
+
+ebbrt::LocalSharedIOBufRefOwner::LocalSharedIOBufRefOwner(
+    const LocalSharedIOBufRefOwner& other)
+    : control_(other.control_) {
+  control_->Acquire();
+}
+
+ebbrt::LocalSharedIOBufRefOwner::~LocalSharedIOBufRefOwner() {
+  control_->Release();
+}
+
+const uint8_t* ebbrt::LocalSharedIOBufRefOwner::Buffer() const {
+  return control_->buf->Buffer();
+}
+
+size_t ebbrt::LocalSharedIOBufRefOwner::Capacity() const {
+  return control_->buf->Capacity();
+}
+
+std::unique_ptr<ebbrt::MutIOBuf>
+ebbrt::MakeLocalSharedChain(std::unique_ptr<IOBuf> buf) {
+  std::unique_ptr<MutIOBuf> head;
+  while (buf) {
+    auto next = buf->Pop();
+    auto ref = IOBuf::Create<MutLocalSharedIOBufRef>(
+        LocalSharedIOBufRef::CloneView, std::move(buf));
+    if (!head) {
+      head = std::move(ref);
+    } else {
+      head->PrependChain(std::move(ref));
+    }
+    buf = std::move(next);
+  }
+  return head;
+}
+
+std::unique_ptr<ebbrt::MutIOBuf>
+ebbrt::CloneLocalSharedRef(const IOBuf& buf) {
+  kassert(dynamic_cast<const MutLocalSharedIOBufRef*>(&buf) != nullptr);
+  return IOBuf::Create<MutLocalSharedIOBufRef>(
+      LocalSharedIOBufRef::CloneView,
+      static_cast<const MutLocalSharedIOBufRef&>(buf));
+}
+
+std::unique_ptr<ebbrt::MutIOBuf>
+ebbrt::SplitLocalSharedRef(std::unique_ptr<IOBuf>& buf, size_t len) {
+  auto rest = buf->Pop();
+  auto back = IOBuf::Create<MutLocalSharedIOBufRef>(
+      LocalSharedIOBufRef::CloneView, std::move(buf));
+  auto front = CloneLocalSharedRef(*back);
+  front->TrimEnd(front->Length() - len);
+  back->Advance(len);
+  if (rest)
+    back->PrependChain(std::move(rest));
+  buf = std::move(back);
+  return front;
+}
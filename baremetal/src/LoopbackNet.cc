@@ -0,0 +1,175 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#include <ebbrt/LoopbackNet.h>
+
+#include <cstring>
+
+#include <ebbrt/Cpu.h>
+#include <ebbrt/EventManager.h>
+#include <ebbrt/NetChecksum.h>
+#include <ebbrt/PooledIOBuf.h>
+#include <ebbrt/Random.h>
+
+ebbrt::LoopbackNetDevice::LoopbackNetDevice(Ipv4Address address)
+    : LoopbackNetDevice(address, Config()) {}
+
+ebbrt::LoopbackNetDevice::LoopbackNetDevice(Ipv4Address address,
+                                            const Config& config)
+    : config_(config), mac_addr_{{0x02, 0x00, 0x00, 0x00, 0x00, 0x01}},
+      itf_(network_manager->NewInterface(*this)) {
+  for (size_t i = 0; i < Cpu::Count(); ++i) {
+    queues_.emplace_back(new CoreQueue(*this));
+  }
+
+  auto addr = std::unique_ptr<NetworkManager::Interface::ItfAddress>(
+      new NetworkManager::Interface::ItfAddress());
+  addr->address = address;
+  addr->netmask = Ipv4Address({255, 0, 0, 0});
+  addr->gateway = address;
+  itf_.SetAddress(std::move(addr));
+}
+
+void ebbrt::LoopbackNetDevice::Send(std::unique_ptr<MutIOBuf> buf,
+                                    PacketInfo pinfo) {
+  auto& q = *queues_[Cpu::GetMine()];
+  auto len = buf->ComputeChainDataLength();
+  ++q.stats.packets;
+  q.stats.bytes += len;
+  if (pinfo.gso_type != PacketInfo::kGsoNone)
+    ++q.stats.gso_packets;
+
+  auto delay = config_.latency;
+  auto eth = reinterpret_cast<const EthernetHeader*>(buf->Data());
+  if (buf->Length() >= sizeof(EthernetHeader) &&
+      eth->type == htons(kEthTypeIp)) {
+    if (config_.loss > 0 && q.Chance(config_.loss)) {
+      ++q.stats.dropped;
+      return;
+    }
+    if (config_.reorder > 0 && q.Chance(config_.reorder)) {
+      ++q.stats.reordered;
+      delay += config_.reorder_delay;
+    }
+  }
+
+  // The frame is copied, so the sender's buffers are released right away and
+  // the receiver owns what it is given
+  auto copy = MakePooledIOBuf(len);
+  auto data = copy->MutData();
+  RxInfo rinfo;
+  if ((pinfo.flags & PacketInfo::kNeedsCsum) && !config_.csum_offload) {
+    auto csum = IpCsumCopy(data, *buf, pinfo.csum_start);
+    // 0 and 0xffff are the same in one's complement, but a zero udp checksum
+    // means none was computed
+    if (csum == 0)
+      csum = 0xffff;
+    memcpy(data + pinfo.csum_start + pinfo.csum_offset, &csum, sizeof(csum));
+    ++q.stats.csums;
+  } else {
+    for (auto& b : *buf) {
+      memcpy(data, b.Data(), b.Length());
+      data += b.Length();
+    }
+    if (pinfo.flags & PacketInfo::kNeedsCsum)
+      rinfo.flags |= RxInfo::kCsumValid;
+  }
+
+  if (delay == std::chrono::microseconds::zero()) {
+    q.ready.emplace_back(std::move(copy), rinfo);
+    q.ScheduleDelivery();
+    return;
+  }
+
+  q.delayed.emplace(clock::Wall::Now() + delay,
+                    RxPacket(std::move(copy), rinfo));
+  q.ArmTimer();
+}
+
+const ebbrt::EthernetAddress& ebbrt::LoopbackNetDevice::GetMacAddress() {
+  return mac_addr_;
+}
+
+ebbrt::LoopbackNetDevice::Stats ebbrt::LoopbackNetDevice::GetStats() const {
+  Stats stats;
+  for (auto& q : queues_) {
+    stats.packets += q->stats.packets;
+    stats.bytes += q->stats.bytes;
+    stats.gso_packets += q->stats.gso_packets;
+    stats.csums += q->stats.csums;
+    stats.dropped += q->stats.dropped;
+    stats.reordered += q->stats.reordered;
+  }
+  return stats;
+}
+
+ebbrt::LoopbackNetDevice::CoreQueue::CoreQueue(LoopbackNetDevice& dev)
+    : dev(dev), rng(random::Get() | 1) {}
+
+// Deliver the ready packets from an event of their own, as a device's
+// interrupt would
+void ebbrt::LoopbackNetDevice::CoreQueue::ScheduleDelivery() {
+  if (delivery_pending)
+    return;
+  delivery_pending = true;
+  event_manager->SpawnLocal([this]() { Deliver(); }, /* force_async = */ true);
+}
+
+void ebbrt::LoopbackNetDevice::CoreQueue::Deliver() {
+  delivery_pending = false;
+  // Packets sent while receiving are left for the next event. A handler may
+  // also block and let another Deliver() run, which carries on from
+  // next_ready, so packets are delivered in the order they became ready.
+  for (auto n = ready.size() - next_ready; n > 0 && next_ready < ready.size();
+       --n) {
+    auto p = std::move(ready[next_ready++]);
+    dev.itf_.Receive(std::move(p.first), p.second);
+  }
+  if (next_ready == ready.size()) {
+    ready.clear();
+    next_ready = 0;
+  }
+}
+
+void ebbrt::LoopbackNetDevice::CoreQueue::Fire() {
+  timer_set = false;
+  auto end = delayed.upper_bound(clock::Wall::Now());
+  for (auto it = delayed.begin(); it != end; ++it) {
+    ready.emplace_back(std::move(it->second));
+  }
+  delayed.erase(delayed.begin(), end);
+  if (!ready.empty())
+    ScheduleDelivery();
+  ArmTimer();
+}
+
+// Make sure the timer fires for the earliest delayed packet
+void ebbrt::LoopbackNetDevice::CoreQueue::ArmTimer() {
+  if (delayed.empty())
+    return;
+
+  auto due = delayed.begin()->first;
+  if (timer_set) {
+    if (timer_due <= due)
+      return;
+    timer->Stop(*this);
+  }
+
+  auto now = clock::Wall::Now();
+  auto timeout = std::chrono::microseconds::zero();
+  if (due > now)
+    timeout = std::chrono::duration_cast<std::chrono::microseconds>(due - now);
+  timer->Start(*this, timeout, /* repeat = */ false);
+  timer_set = true;
+  timer_due = due;
+}
+
+bool ebbrt::LoopbackNetDevice::CoreQueue::Chance(double p) {
+  // xorshift64*, plenty for picking packets to drop
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  auto r = (rng * 0x2545f4914f6cdd1dull) >> 11;
+  return r < p * (1ull << 53);
+}
@@ -154,10 +154,16 @@ ebbrt::Main(multiboot::Information* mbi) {
         event_manager->ReceiveToken();
 #if __EBBRT_ENABLE_NETWORKING__
         NetworkManager::Init();
+#if __EBBRT_ENABLE_LOOPBACK_NETWORK__
+        // No nic is probed, the application brings up a LoopbackNetDevice
+        auto net_ready = MakeReadyFuture<void>();
+#else
         pci::Init();
         pci::RegisterProbe(VirtioNetDriver::Probe);
         pci::LoadDrivers();
-        network_manager->StartDhcp().Then([](Future<void> fut) {
+        auto net_ready = network_manager->StartDhcp();
+#endif
+        net_ready.Then([](Future<void> fut) {
           fut.Get();
 // Dhcp completed
 #if __EBBRT_ENABLE_DISTRIBUTED_RUNTIME__
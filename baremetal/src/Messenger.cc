@@ -5,8 +5,8 @@
 #include <ebbrt/Messenger.h>
 
 #include <ebbrt/Debug.h>
+#include <ebbrt/LocalSharedIOBufRef.h>
 #include <ebbrt/Message.h>
-#include <ebbrt/SharedIOBufRef.h>
 #include <ebbrt/UniqueIOBuf.h>
 
 uint16_t ebbrt::Messenger::port_;
@@ -109,10 +109,10 @@ ebbrt::Messenger::Connection::process_message_chain(
   // we "divide" the buffer by clone and resize
   auto left_shard_len = split->Length() - (length - message_len);
   auto right_shard_len = split->Length() - left_shard_len;
-  auto split_c = IOBuf::Create<MutSharedIOBufRef>(SharedIOBufRef::CloneView,
-                                                  std::move(split));
-  auto remainder =
-      IOBuf::Create<MutSharedIOBufRef>(SharedIOBufRef::CloneView, *split_c);
+  auto split_c = IOBuf::Create<MutLocalSharedIOBufRef>(
+      LocalSharedIOBufRef::CloneView, std::move(split));
+  auto remainder = IOBuf::Create<MutLocalSharedIOBufRef>(
+      LocalSharedIOBufRef::CloneView, *split_c);
   split_c->TrimEnd(right_shard_len);
   remainder->Advance(left_shard_len);
 
@@ -12,7 +12,8 @@ ebbrt::NetworkManager::NewInterface(EthernetDevice& ether_dev) {
   return *interface_;
 }
 
-void ebbrt::NetworkManager::Interface::Receive(std::unique_ptr<MutIOBuf> buf) {
+void ebbrt::NetworkManager::Interface::Receive(std::unique_ptr<MutIOBuf> buf,
+                                               RxInfo rinfo) {
   auto packet_len = buf->ComputeChainDataLength();
 
   // Drop packets that are too small
@@ -26,7 +27,7 @@ void ebbrt::NetworkManager::Interface::Receive(std::unique_ptr<MutIOBuf> buf) {
 
   switch (ntohs(eth_header.type)) {
   case kEthTypeIp: {
-    ReceiveIp(eth_header, std::move(buf));
+    ReceiveIp(eth_header, std::move(buf), rinfo);
     break;
   }
   case kEthTypeArp: {
@@ -40,7 +41,7 @@ const ebbrt::EthernetAddress& ebbrt::NetworkManager::Interface::MacAddress() {
   return ether_dev_.GetMacAddress();
 }
 
-void ebbrt::NetworkManager::Interface::Send(std::unique_ptr<IOBuf> b,
+void ebbrt::NetworkManager::Interface::Send(std::unique_ptr<MutIOBuf> b,
                                             PacketInfo pinfo) {
   ether_dev_.Send(std::move(b), std::move(pinfo));
 }
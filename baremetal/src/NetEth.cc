@@ -35,14 +35,20 @@ void ebbrt::NetworkManager::Interface::EthArpSend(uint16_t proto,
       local_dest = addr->gateway;
     }
 
+    // A packet waiting on arp is sent later on its own, so only a packet sent
+    // right away may say that more follow
+    auto more = pinfo.flags & PacketInfo::kMore;
+    pinfo.flags &= ~PacketInfo::kMore;
+
     // lambda to send the packet given the destination MAC address
-    auto send_func = [ this, proto, pinfo,
-                       buf = std::move(buf) ](EthernetAddress addr) mutable {
+    auto send_func = [ this, proto, pinfo, buf = std::move(buf) ](
+        EthernetAddress addr, uint8_t more = 0) mutable {
       auto dp = buf->GetMutDataPointer();
       auto& eth_header = dp.Get<EthernetHeader>();
       eth_header.dst = addr;
       eth_header.src = MacAddress();
       eth_header.type = htons(proto);
+      pinfo.flags |= more;
       Send(std::move(buf), pinfo);
     };
 
@@ -76,7 +82,7 @@ void ebbrt::NetworkManager::Interface::EthArpSend(uint16_t proto,
       entry->queue.Push(std::move(send_func));
     } else {
       // got addr, just send right away
-      send_func(*eth_addr);
+      send_func(*eth_addr, more);
     }
   }
 }
@@ -142,7 +148,8 @@ void ebbrt::NetworkManager::Interface::ReceiveArp(
 
 // Request an ARP reply for a given entry
 void ebbrt::NetworkManager::Interface::EthArpRequest(ArpEntry& entry) {
-  auto buf = MakeUniqueIOBuf(sizeof(EthernetHeader) + sizeof(ArpPacket));
+  auto buf = MakeUniqueIOBufWithHeadroom(
+      EthernetDevice::kHeadroom, sizeof(EthernetHeader) + sizeof(ArpPacket));
   auto dp = buf->GetMutDataPointer();
   auto& eth_header = dp.Get<EthernetHeader>();
   auto& arp_packet = dp.Get<ArpPacket>();
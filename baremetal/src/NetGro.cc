@@ -0,0 +1,190 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#include <ebbrt/NetGro.h>
+
+#include <cstring>
+
+namespace {
+const constexpr size_t kIpOffset = sizeof(ebbrt::EthernetHeader);
+const constexpr size_t kTcpOffset = kIpOffset + sizeof(ebbrt::Ipv4Header);
+// Largest ip length a merged packet may reach
+const constexpr size_t kMaxIpLen = 0xffff;
+// A merged segment may only carry these flags, a PSH ends the merge
+const constexpr uint16_t kMergeFlags = ebbrt::kTcpAck | ebbrt::kTcpPsh;
+
+struct Headers {
+  ebbrt::EthernetHeader* eth;
+  ebbrt::Ipv4Header* ip;
+  ebbrt::TcpHeader* tcp;
+  // length of all headers
+  size_t len;
+  size_t payload;
+};
+
+// Headers of a packet which has already been checked with ParseTcp()
+Headers GetHeaders(ebbrt::MutIOBuf& buf) {
+  auto data = buf.MutData();
+  Headers h;
+  h.eth = reinterpret_cast<ebbrt::EthernetHeader*>(data);
+  h.ip = reinterpret_cast<ebbrt::Ipv4Header*>(data + kIpOffset);
+  h.tcp = reinterpret_cast<ebbrt::TcpHeader*>(data + kTcpOffset);
+  h.len = kTcpOffset + h.tcp->HdrLen();
+  h.payload = 0;
+  return h;
+}
+
+// Returns true if buf is a TCP/IPv4 packet with all of its headers in the
+// first buffer of the chain
+bool ParseTcp(ebbrt::MutIOBuf& buf, Headers& h) {
+  if (buf.Length() < kTcpOffset + sizeof(ebbrt::TcpHeader))
+    return false;
+
+  h = GetHeaders(buf);
+  // No ip options or fragments
+  if (h.eth->type != ebbrt::htons(ebbrt::kEthTypeIp) ||
+      h.ip->version_ihl != 0x45 || h.ip->proto != ebbrt::kIpProtoTCP ||
+      h.ip->Fragmented())
+    return false;
+
+  auto tcp_hdr_len = h.tcp->HdrLen();
+  auto ip_len = h.ip->TotalLength();
+  // Padded or truncated packets are left to the regular receive path
+  if (tcp_hdr_len < sizeof(ebbrt::TcpHeader) || buf.Length() < h.len ||
+      ip_len < sizeof(ebbrt::Ipv4Header) + tcp_hdr_len ||
+      kIpOffset + ip_len != buf.ComputeChainDataLength())
+    return false;
+
+  h.payload = ip_len - sizeof(ebbrt::Ipv4Header) - tcp_hdr_len;
+  return true;
+}
+
+bool SameFlow(const Headers& a, const Headers& b) {
+  return a.tcp->src_port == b.tcp->src_port &&
+         a.tcp->dst_port == b.tcp->dst_port && a.ip->src == b.ip->src &&
+         a.ip->dst == b.ip->dst &&
+         memcmp(a.eth, b.eth, sizeof(ebbrt::EthernetHeader)) == 0;
+}
+
+// A segment can be merged if it carries data and no flags which need to be
+// processed on their own
+bool Mergeable(const Headers& h) {
+  auto flags = ebbrt::ntohs(h.tcp->hdrlen_flags) & 0xfff;
+  return h.payload > 0 && (flags & ebbrt::kTcpAck) && !(flags & ~kMergeFlags);
+}
+
+// Whether the segment h directly follows the held segment, with identical
+// headers apart from the sequence number and PSH
+bool Continues(const Headers& held, uint32_t next_seq, size_t ip_len,
+               const Headers& h) {
+  return ebbrt::ntohl(h.tcp->seqno) == next_seq &&
+         ip_len + h.payload <= kMaxIpLen &&
+         h.tcp->ackno == held.tcp->ackno && h.tcp->wnd == held.tcp->wnd &&
+         (h.tcp->hdrlen_flags & ~ebbrt::htons(ebbrt::kTcpPsh)) ==
+             held.tcp->hdrlen_flags &&
+         h.ip->dscp_ecn == held.ip->dscp_ecn && h.ip->ttl == held.ip->ttl &&
+         memcmp(h.tcp->options, held.tcp->options,
+                h.len - kTcpOffset - sizeof(ebbrt::TcpHeader)) == 0;
+}
+}  // namespace
+
+void ebbrt::GenericReceiveOffload::Receive(std::unique_ptr<MutIOBuf> buf,
+                                           RxInfo rinfo) {
+  Headers h;
+  if (!ParseTcp(*buf, h)) {
+    Deliver(std::move(buf), rinfo);
+    return;
+  }
+
+  auto mergeable = (rinfo.flags & RxInfo::kCsumValid) && Mergeable(h);
+
+  Flow* slot = nullptr;
+  for (auto& flow : flows_) {
+    if (!flow.buf) {
+      if (slot == nullptr)
+        slot = &flow;
+      continue;
+    }
+
+    auto held = GetHeaders(*flow.buf);
+    if (!SameFlow(held, h))
+      continue;
+
+    if (mergeable && Continues(held, flow.next_seq, flow.ip_len, h)) {
+      auto push = h.tcp->Flags() & kTcpPsh;
+      buf->Advance(h.len);
+      flow.buf->PrependChain(std::move(buf));
+      flow.next_seq += h.payload;
+      flow.ip_len += h.payload;
+      ++flow.segments;
+      ++stats_.merged;
+      if (push) {
+        held.tcp->hdrlen_flags |= htons(kTcpPsh);
+        FlushFlow(flow);
+      }
+      return;
+    }
+
+    // Anything else in the flow must be received after what is held
+    FlushFlow(flow);
+    slot = &flow;
+    break;
+  }
+
+  if (!mergeable || (h.tcp->Flags() & kTcpPsh)) {
+    Deliver(std::move(buf), rinfo);
+    return;
+  }
+
+  if (slot == nullptr) {
+    slot = &flows_[next_evict_];
+    next_evict_ = (next_evict_ + 1) % kMaxFlows;
+    FlushFlow(*slot);
+  }
+
+  slot->next_seq = ntohl(h.tcp->seqno) + h.payload;
+  slot->ip_len = h.ip->TotalLength();
+  slot->segments = 1;
+  slot->buf = std::move(buf);
+}
+
+void ebbrt::GenericReceiveOffload::Flush() {
+  for (auto& flow : flows_) {
+    FlushFlow(flow);
+  }
+  next_evict_ = 0;
+
+  // A handler may block and let another batch through, whose packets are
+  // queued behind the ones this call has yet to deliver. Whichever call runs
+  // next takes the packet at out_next_, so they are delivered in order.
+  while (out_next_ < out_.size()) {
+    auto p = std::move(out_[out_next_++]);
+    itf_.Receive(std::move(p.first), p.second);
+  }
+  out_.clear();
+  out_next_ = 0;
+}
+
+void ebbrt::GenericReceiveOffload::Deliver(std::unique_ptr<MutIOBuf> buf,
+                                           RxInfo rinfo) {
+  ++stats_.delivered;
+  out_.emplace_back(std::move(buf), rinfo);
+}
+
+void ebbrt::GenericReceiveOffload::FlushFlow(Flow& flow) {
+  if (!flow.buf)
+    return;
+
+  if (flow.segments > 1) {
+    auto h = GetHeaders(*flow.buf);
+    h.ip->length = htons(flow.ip_len);
+    h.ip->chksum = 0;
+    h.ip->chksum = h.ip->ComputeChecksum();
+    // The tcp checksum is left covering the first segment only, every merged
+    // segment was validated so the receive path does not verify it
+  }
+  RxInfo rinfo;
+  rinfo.flags = RxInfo::kCsumValid;
+  Deliver(std::move(flow.buf), rinfo);
+}
@@ -29,7 +29,7 @@ bool ebbrt::NetworkManager::Interface::ItfAddress::isLocalNetwork(
 
 // Receive an Ipv4 packet
 void ebbrt::NetworkManager::Interface::ReceiveIp(
-    EthernetHeader& eth_header, std::unique_ptr<MutIOBuf> buf) {
+    EthernetHeader& eth_header, std::unique_ptr<MutIOBuf> buf, RxInfo rinfo) {
   auto packet_len = buf->ComputeChainDataLength();
 
   if (unlikely(packet_len < sizeof(Ipv4Header)))
@@ -79,11 +79,11 @@ void ebbrt::NetworkManager::Interface::ReceiveIp(
     break;
   }
   case kIpProtoUDP: {
-    ReceiveUdp(ip_header, std::move(buf));
+    ReceiveUdp(ip_header, std::move(buf), rinfo);
     break;
   }
   case kIpProtoTCP: {
-    ReceiveTcp(ip_header, std::move(buf));
+    ReceiveTcp(ip_header, std::move(buf), rinfo);
     break;
   }
   }
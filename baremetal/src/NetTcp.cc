@@ -4,12 +4,21 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 #include <ebbrt/Net.h>
 
-#include <ebbrt/IOBufRef.h>
+#include <algorithm>
+#include <cstring>
+
+#include <ebbrt/LocalSharedIOBufRef.h>
 #include <ebbrt/NetChecksum.h>
+#include <ebbrt/PooledIOBuf.h>
 #include <ebbrt/Random.h>
 #include <ebbrt/Timer.h>
 #include <ebbrt/UniqueIOBuf.h>
 
+namespace {
+// How often output held back by a congested device is retried
+const constexpr auto kSendPausePoll = std::chrono::microseconds(20);
+}  // namespace
+
 // Destroy a listening tcp pcb
 void ebbrt::NetworkManager::ListeningTcpPcb::ListeningTcpEntryDeleter::
 operator()(ListeningTcpEntry* e) {
@@ -116,9 +125,8 @@ uint16_t ebbrt::NetworkManager::TcpPcb::Connect(Ipv4Address address,
   // the handshake doesn't complete
 
   auto optlen = 4;  // for MSS
-  auto new_buf = MakeUniqueIOBuf(optlen + sizeof(TcpHeader) +
-                                 sizeof(Ipv4Header) + sizeof(EthernetHeader));
-  new_buf->Advance(sizeof(Ipv4Header) + sizeof(EthernetHeader));
+  auto new_buf = MakeUniqueIOBufWithHeadroom(kTxHeadroom,
+                                             optlen + sizeof(TcpHeader));
   auto dp = new_buf->GetMutDataPointer();
   auto& tcp_header = dp.Get<TcpHeader>();
   auto opts = reinterpret_cast<uint32_t*>((&tcp_header) + 1);
@@ -189,7 +197,7 @@ ebbrt::Ipv4Address ebbrt::NetworkManager::TcpPcb::GetRemoteAddress() {
 
 // Receive a TCP packet on an interface
 void ebbrt::NetworkManager::Interface::ReceiveTcp(
-    const Ipv4Header& ih, std::unique_ptr<MutIOBuf> buf) {
+    const Ipv4Header& ih, std::unique_ptr<MutIOBuf> buf, RxInfo rinfo) {
   auto packet_len = buf->ComputeChainDataLength();
 
   // Ensure we have a header
@@ -204,9 +212,9 @@ void ebbrt::NetworkManager::Interface::ReceiveTcp(
   if (unlikely(addr->isBroadcast(ih.dst) || ih.dst.isMulticast()))
     return;
 
-  // XXX: Check if rxcsum is supported
-  // if (unlikely(IpPseudoCsum(*buf, ih.proto, ih.src, ih.dst)))
-  //   return;
+  if (!(rinfo.flags & RxInfo::kCsumValid) &&
+      unlikely(IpPseudoCsum(*buf, ih.proto, ih.src, ih.dst)))
+    return;
 
   auto hdr_len = tcp_header.HdrLen();
   if (unlikely(hdr_len < sizeof(TcpHeader) || hdr_len > packet_len))
@@ -308,12 +316,16 @@ void ebbrt::NetworkManager::TcpEntry::SetTimer(
 
   ebbrt::clock::Wall::time_point min_timer;
   if (now >= retransmit && now >= time_wait) {
-    return;
+    if (!send_paused)
+      return;
+    min_timer = now + kSendPausePoll;
   } else if (now >= retransmit) {
     min_timer = time_wait;
   } else {
     min_timer = retransmit;
   }
+  if (send_paused)
+    min_timer = std::min(min_timer, now + kSendPausePoll);
 
   auto duration =
       std::chrono::duration_cast<std::chrono::microseconds>(min_timer - now);
@@ -413,9 +425,8 @@ void ebbrt::NetworkManager::ListeningTcpEntry::Input(
 
     // Create a SYN-ACK reply
     auto optlen = 4;  // for MSS
-    auto new_buf = MakeUniqueIOBuf(optlen + sizeof(TcpHeader) +
-                                   sizeof(Ipv4Header) + sizeof(EthernetHeader));
-    new_buf->Advance(sizeof(Ipv4Header) + sizeof(EthernetHeader));
+    auto new_buf = MakeUniqueIOBufWithHeadroom(kTxHeadroom,
+                                               optlen + sizeof(TcpHeader));
     auto dp = new_buf->GetMutDataPointer();
     auto& tcp_header = dp.Get<TcpHeader>();
     auto opts = reinterpret_cast<uint32_t*>((&tcp_header) + 1);
@@ -478,9 +489,7 @@ bool TcpSeqGEQ(uint32_t first, uint32_t second) {
 // Send on a TCP connection
 void ebbrt::NetworkManager::TcpEntry::Send(std::unique_ptr<IOBuf> buf) {
   // Prepend a header to the chain which will Ack any received data
-  auto header_buf = MakeUniqueIOBuf(sizeof(TcpHeader) + sizeof(Ipv4Header) +
-                                    sizeof(EthernetHeader));
-  header_buf->Advance(sizeof(Ipv4Header) + sizeof(EthernetHeader));
+  auto header_buf = MakePooledIOBufWithHeadroom(kTxHeadroom, sizeof(TcpHeader));
   header_buf->PrependChain(std::move(buf));
   auto dp = header_buf->GetMutDataPointer();
   auto& tcp_header = dp.Get<TcpHeader>();
@@ -846,16 +855,15 @@ bool ebbrt::NetworkManager::TcpEntry::Receive(
 
 void ebbrt::NetworkManager::TcpEntry::ClearAckedSegments(const TcpInfo& info) {
   // Function to clear acked segments from a queue
-  auto clear_acked_segments =
-      [&info](boost::container::list<TcpSegment>& queue) {
-        auto it = queue.begin();
-        while (it != queue.end()) {
-          if (TcpSeqGT(ntohl(it->th.seqno) + it->SeqLen(), info.ackno))
-            break;
-          auto prev_it = it++;
-          queue.erase(prev_it);
-        }
-      };
+  auto clear_acked_segments = [&info](TcpSegmentList& queue) {
+    auto it = queue.begin();
+    while (it != queue.end()) {
+      if (TcpSeqGT(ntohl(it->th.seqno) + it->SeqLen(), info.ackno))
+        break;
+      auto prev_it = it++;
+      queue.erase(prev_it);
+    }
+  };
 
   // Remove all unacked segments that have been completely acked by
   // this ACK
@@ -886,6 +894,14 @@ void ebbrt::NetworkManager::TcpEntry::EnqueueSegment(
   // ackno, wnd, and checksum are set in Output()
   th.urgp = 0;
 
+  // Transmissions reference the payload rather than copy it. The references
+  // keep the data alive while the device sends it, even if the segment is
+  // acked or purged meanwhile.
+  if (buf->IsChained()) {
+    auto payload = buf->Pop();
+    buf->PrependChain(MakeLocalSharedChain(std::move(payload)));
+  }
+
   pending_segments.emplace_back(std::move(buf), th, tcp_len);
 
   snd_nxt += tcp_len;
@@ -895,23 +911,51 @@ void ebbrt::NetworkManager::TcpEntry::EnqueueSegment(
 size_t
 ebbrt::NetworkManager::TcpEntry::Output(ebbrt::clock::Wall::time_point now) {
   auto it = pending_segments.begin();
+  NetworkManager::Interface* itf = nullptr;
+
+  // While the device is congested the segments stay pending, rather than
+  // being dropped by the device and waiting for a retransmit timeout. The
+  // timer polls until the device catches up.
+  if (it != pending_segments.end()) {
+    itf = network_manager->IpRoute(std::get<0>(key));
+    auto paused = itf != nullptr && itf->SendCongested();
+    if (paused && !send_paused && timer_set) {
+      // rearm the timer for the poll
+      timer->Stop(*this);
+      timer_set = false;
+    }
+    send_paused = paused;
+  } else {
+    send_paused = false;
+  }
 
   // try to send as many pending segments as will fit in the window
   size_t sent = 0;
-  for (; it != pending_segments.end() &&
+  for (; !send_paused && it != pending_segments.end() &&
          TcpSeqLEQ(ntohl(it->th.seqno) + it->tcp_len,
                    snd_nxt + SendWindowRemaining());
        ++it) {
-    SendSegment(*it);
     ++sent;
   }
 
+  // The device is notified once, for the last segment. That segment may not
+  // reach the device, e.g. if it waits on arp, so the device is flushed too.
+  auto left = sent;
+  for (auto& segment : pending_segments) {
+    if (left == 0)
+      break;
+    SendSegment(segment, --left > 0);
+  }
+  if (sent && itf != nullptr)
+    itf->SendFlush();
+
   // If we sent some segments, add them to the unacked list
   if (sent) {
     unacked_segments.splice(unacked_segments.end(), std::move(pending_segments),
                             pending_segments.begin(), it, sent);
   } else {
-    if (!pending_segments.empty() && unacked_segments.empty()) {
+    if (!send_paused && !pending_segments.empty() &&
+        unacked_segments.empty()) {
       // If we have no outstanding segments to be acked and there is at least
       // one segment pending, we need either:
       if (snd_wnd > 0) {
@@ -939,9 +983,7 @@ ebbrt::NetworkManager::TcpEntry::Output(ebbrt::clock::Wall::time_point now) {
 
 // Send an Ack with no data
 void ebbrt::NetworkManager::TcpEntry::SendEmptyAck() {
-  auto buf = MakeUniqueIOBuf(sizeof(TcpHeader) + sizeof(Ipv4Header) +
-                             sizeof(EthernetHeader));
-  buf->Advance(sizeof(Ipv4Header) + sizeof(EthernetHeader));
+  auto buf = MakePooledIOBufWithHeadroom(kTxHeadroom, sizeof(TcpHeader));
   auto dp = buf->GetMutDataPointer();
   auto& th = dp.Get<TcpHeader>();
   th.src_port = htons(std::get<2>(key));
@@ -1001,16 +1043,15 @@ void ebbrt::NetworkManager::TcpEntry::SendFin() {
   }
 
   // Otherwise create an empty segment with a Fin
-  auto buf = MakeUniqueIOBuf(sizeof(TcpHeader) + sizeof(Ipv4Header) +
-                             sizeof(EthernetHeader));
-  buf->Advance(sizeof(Ipv4Header) + sizeof(EthernetHeader));
+  auto buf = MakeUniqueIOBufWithHeadroom(kTxHeadroom, sizeof(TcpHeader));
   auto dp = buf->GetMutDataPointer();
   auto& tcp_header = dp.Get<TcpHeader>();
   EnqueueSegment(tcp_header, std::move(buf), kTcpFin | kTcpAck);
 }
 
 // Actually send a segment via IP
-void ebbrt::NetworkManager::TcpEntry::SendSegment(TcpSegment& segment) {
+void ebbrt::NetworkManager::TcpEntry::SendSegment(TcpSegment& segment,
+                                                  bool more) {
   rcv_last_acked = rcv_nxt;
   segment.th.ackno = htonl(rcv_nxt);
   segment.th.wnd = htons(TcpWindow16(rcv_wnd));
@@ -1020,6 +1061,8 @@ void ebbrt::NetworkManager::TcpEntry::SendSegment(TcpSegment& segment) {
       OffloadPseudoCsum(*(segment.buf), kIpProtoTCP, address, std::get<0>(key));
   PacketInfo pinfo;
   pinfo.flags |= PacketInfo::kNeedsCsum;
+  if (more)
+    pinfo.flags |= PacketInfo::kMore;
   pinfo.csum_start = 0;
   pinfo.csum_offset = 16;  // checksum is 16 bytes into the TCP header
 
@@ -1031,8 +1074,17 @@ void ebbrt::NetworkManager::TcpEntry::SendSegment(TcpSegment& segment) {
     pinfo.gso_size = mss;
   }
 
-  network_manager->SendIp(CreateRefChain(*(segment.buf)), address,
-                          std::get<0>(key), kIpProtoTCP, std::move(pinfo));
+  // The header is copied for each transmission, so a retransmission never
+  // rewrites a header the device may still be reading
+  auto& header = *segment.buf;
+  auto buf = MakePooledIOBufWithHeadroom(kTxHeadroom, header.Length());
+  memcpy(buf->MutData(), header.Data(), header.Length());
+  for (auto it = ++(segment.buf->begin()); it != segment.buf->end(); ++it) {
+    buf->PrependChain(CloneLocalSharedRef(*it));
+  }
+
+  network_manager->SendIp(std::move(buf), address, std::get<0>(key),
+                          kIpProtoTCP, std::move(pinfo));
 }
 
 // Send a reset packet
@@ -1041,10 +1093,7 @@ void ebbrt::NetworkManager::TcpReset(bool ack, uint32_t seqno, uint32_t ackno,
                                      const Ipv4Address& remote_ip,
                                      uint16_t local_port,
                                      uint16_t remote_port) {
-  auto buf = MakeUniqueIOBuf(sizeof(TcpHeader) + sizeof(Ipv4Header) +
-                             sizeof(EthernetHeader));
-
-  buf->Advance(sizeof(Ipv4Header) + sizeof(EthernetHeader));
+  auto buf = MakeUniqueIOBufWithHeadroom(kTxHeadroom, sizeof(TcpHeader));
 
   auto dp = buf->GetMutDataPointer();
   auto& tcp_header = dp.Get<TcpHeader>();
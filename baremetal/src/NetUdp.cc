@@ -6,7 +6,7 @@
 
 #include <ebbrt/NetChecksum.h>
 #include <ebbrt/NetUdp.h>
-#include <ebbrt/UniqueIOBuf.h>
+#include <ebbrt/PooledIOBuf.h>
 
 // Close a listening connection. Note that Receive could still be called until
 // the future is fulfilled
@@ -58,7 +58,7 @@ void ebbrt::NetworkManager::UdpPcb::Receive(
 
 // Receive UDP packet on an interface
 void ebbrt::NetworkManager::Interface::ReceiveUdp(
-    Ipv4Header& ip_header, std::unique_ptr<MutIOBuf> buf) {
+    Ipv4Header& ip_header, std::unique_ptr<MutIOBuf> buf, RxInfo rinfo) {
   auto packet_len = buf->ComputeChainDataLength();
 
   // Ensure we have a header
@@ -75,10 +75,11 @@ void ebbrt::NetworkManager::Interface::ReceiveUdp(
   // trim any excess off the packet
   buf->TrimEnd(packet_len - ntohs(udp_header.length));
 
-  // XXX: Check if rxcsum supported
-  // if (udp_header.checksum &&
-  //     IpPseudoCsum(*buf, ip_header.proto, ip_header.src, ip_header.dst))
-  //   return;
+  // A zero checksum means the sender did not compute one
+  if (!(rinfo.flags & RxInfo::kCsumValid) && udp_header.checksum &&
+      unlikely(
+          IpPseudoCsum(*buf, ip_header.proto, ip_header.src, ip_header.dst)))
+    return;
 
   auto entry = network_manager->udp_pcbs_.find(ntohs(udp_header.dst_port));
 
@@ -127,9 +128,7 @@ void ebbrt::NetworkManager::Interface::SendUdp(UdpPcb& pcb, Ipv4Address addr,
     throw std::runtime_error("Send on unbound pcb");
 
   // Construct header
-  auto header_buf = MakeUniqueIOBuf(sizeof(UdpHeader) + sizeof(Ipv4Header) +
-                                    sizeof(EthernetHeader));
-  header_buf->Advance(sizeof(Ipv4Header) + sizeof(EthernetHeader));
+  auto header_buf = MakePooledIOBufWithHeadroom(kTxHeadroom, sizeof(UdpHeader));
   auto dp = header_buf->GetMutDataPointer();
   auto& udp_header = dp.Get<UdpHeader>();
   udp_header.src_port = htons(src_port);
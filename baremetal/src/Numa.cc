@@ -4,6 +4,8 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 #include <ebbrt/Numa.h>
 
+#include <algorithm>
+
 #include <boost/utility.hpp>
 
 #include <ebbrt/Cpu.h>
@@ -39,6 +41,19 @@ void ebbrt::numa::Init() {
       numa_node.pfn_end = boost::prior(numa_node.memblocks.end())->end;
     }
   }
+
+  for (size_t i = 0; i < nodes->size(); ++i) {
+    auto& numa_node = (*nodes)[i];
+    numa_node.fallback.clear();
+    for (size_t j = 0; j < nodes->size(); ++j) {
+      numa_node.fallback.emplace_back(j);
+    }
+    std::stable_sort(numa_node.fallback.begin(), numa_node.fallback.end(),
+                     [&numa_node](const Nid& lhs, const Nid& rhs) {
+                       return numa_node.distances[lhs.val()] <
+                              numa_node.distances[rhs.val()];
+                     });
+  }
 }
 
 void ebbrt::numa::EarlyInit() {
@@ -55,6 +70,9 @@ ebbrt::Nid ebbrt::numa::SetupNode(size_t proximity_domain) {
   if (node == Nid::None()) {
     nodes->emplace_back();
     node = Nid(nodes->size() - 1);
+    auto& distances = nodes->back().distances;
+    std::fill(distances.begin(), distances.end(), kRemoteDistance);
+    distances[node.val()] = kLocalDistance;
     pxm_to_node_map[proximity_domain] = node;
     node_to_pxm_map[node.val()] = proximity_domain;
   }
@@ -71,3 +89,24 @@ void ebbrt::numa::AddMemBlock(ebbrt::Nid nid, ebbrt::Pfn start,
                               ebbrt::Pfn end) {
   (*nodes)[nid.val()].memblocks.emplace_back(start, end, nid);
 }
+
+void ebbrt::numa::SetPxmDistance(size_t from_pxm, size_t to_pxm,
+                                 uint8_t distance) {
+  if (from_pxm >= kMaxPxmDomains || to_pxm >= kMaxPxmDomains)
+    return;
+  auto from = pxm_to_node_map[from_pxm];
+  auto to = pxm_to_node_map[to_pxm];
+  // Domains with neither cpus nor memory have no node
+  if (from == Nid::None() || to == Nid::None())
+    return;
+  (*nodes)[from.val()].distances[to.val()] = distance;
+}
+
+uint8_t ebbrt::numa::Distance(Nid from, Nid to) {
+  return (*nodes)[from.val()].distances[to.val()];
+}
+
+const boost::container::static_vector<ebbrt::Nid, ebbrt::numa::kMaxNodes>&
+ebbrt::numa::FallbackOrder(Nid nid) {
+  return (*nodes)[nid.val()].fallback;
+}
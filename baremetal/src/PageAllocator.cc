@@ -9,6 +9,7 @@
 #include <boost/container/static_vector.hpp>
 
 #include <ebbrt/Align.h>
+#include <ebbrt/Compiler.h>
 #include <ebbrt/Cpu.h>
 #include <ebbrt/Debug.h>
 #include <ebbrt/EarlyPageAllocator.h>
@@ -74,7 +75,8 @@ ebbrt::PageAllocator& ebbrt::PageAllocator::HandleFault(EbbId id) {
   return allocator;
 }
 
-ebbrt::PageAllocator::PageAllocator(Nid nid) : nid_(nid) {}
+ebbrt::PageAllocator::PageAllocator(Nid nid)
+    : nid_(nid), remote_allocations_(0) {}
 
 ebbrt::Pfn ebbrt::PageAllocator::AllocLocal(size_t order, uint64_t max_addr) {
   std::lock_guard<SpinLock> lock(lock_);
@@ -116,6 +118,24 @@ ebbrt::Pfn ebbrt::PageAllocator::AllocLocal(size_t order, uint64_t max_addr) {
 
 ebbrt::Pfn ebbrt::PageAllocator::Alloc(size_t order, Nid nid,
                                        uint64_t max_addr) {
+  auto ret = AllocNoFallback(order, nid, max_addr);
+  if (likely(ret != Pfn::None()))
+    return ret;
+
+  for (const auto& fallback : numa::FallbackOrder(nid)) {
+    if (fallback == nid)
+      continue;
+    ret = (*allocators)[fallback.val()].AllocLocal(order, max_addr);
+    if (ret != Pfn::None()) {
+      ++(*allocators)[nid.val()].remote_allocations_;
+      return ret;
+    }
+  }
+  return Pfn::None();
+}
+
+ebbrt::Pfn ebbrt::PageAllocator::AllocNoFallback(size_t order, Nid nid,
+                                                 uint64_t max_addr) {
   if (nid == nid_) {
     return AllocLocal(order, max_addr);
   } else {
@@ -133,6 +153,14 @@ void ebbrt::PageAllocator::FreePageNoCoalesce(Pfn pfn, size_t order) {
 }
 
 void ebbrt::PageAllocator::Free(Pfn pfn, size_t order) {
+  // Pages go back to the node they came from, which may not be ours if the
+  // allocation fell back to another node
+  auto pfn_page = mem_map::PfnToPage(pfn);
+  kassert(pfn_page != nullptr);
+  if (unlikely(pfn_page->nid != nid_.val())) {
+    (*allocators)[pfn_page->nid].Free(pfn, order);
+    return;
+  }
   std::lock_guard<SpinLock> lock(lock_);
 #ifdef PAGE_CHECKER
   kassert(Release(pfn, order));
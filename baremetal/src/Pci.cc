@@ -229,7 +229,8 @@ ebbrt::pci::Bar::~Bar() {
 bool ebbrt::pci::Bar::Is64() const { return is_64_; }
 
 void ebbrt::pci::Bar::Map() {
-  if (!mmio_)
+  // Several users may share a bar, e.g. the msix table and device registers
+  if (!mmio_ || vaddr_ != nullptr)
     return;
 
   auto npages = align::Up(size_, pmem::kPageSize) >> pmem::kPageShift;
@@ -320,6 +321,20 @@ uint8_t ebbrt::pci::Device::FindCapability(uint8_t capability) const {
   return 0xFF;
 }
 
+std::vector<uint8_t>
+ebbrt::pci::Device::FindCapabilities(uint8_t capability) const {
+  std::vector<uint8_t> ret;
+  auto ptr = Read8(kCapabilitiesPtrAddr);
+  while (ptr != 0) {
+    if (Read8(ptr) == capability)
+      ret.push_back(ptr);
+
+    ptr = Read8(ptr + 1);
+  }
+
+  return ret;
+}
+
 uint32_t ebbrt::pci::Device::GetBarRaw(uint8_t idx) const {
   return Read32(BarAddr(idx));
 }
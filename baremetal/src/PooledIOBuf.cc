@@ -0,0 +1,216 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#include <ebbrt/PooledIOBuf.h>
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <ebbrt/CacheAligned.h>
+#include <ebbrt/Compiler.h>
+#include <ebbrt/Cpu.h>
+#include <ebbrt/EventManager.h>
+#include <ebbrt/GeneralPurposeAllocator.h>
+
+namespace {
+// Every buffer is prefixed by a header recording which pool it belongs to
+struct alignas(16) BlockHeader {
+  BlockHeader* next;
+  uint16_t cpu;
+  uint8_t cls;
+};
+static_assert(sizeof(BlockHeader) == ebbrt::kPooledIOBufHeaderSize,
+              "Block header size mismatch");
+
+const constexpr size_t kOverhead =
+    sizeof(BlockHeader) + sizeof(ebbrt::MutPooledIOBuf);
+
+// Block sizes are gp allocator size classes so no slab space is wasted. They
+// hold a standard frame, a page (for device receive rings), a 9K jumbo frame
+// and a 64K segment respectively
+const constexpr size_t kNumClasses = 4;
+const constexpr std::array<size_t, kNumClasses> kBlockSizes = {
+    {2 * 1024, 4 * 1024, 10 * 1024, 80 * 1024}};
+// Blocks cached per core beyond these go back to the gp allocator
+const constexpr std::array<size_t, kNumClasses> kMaxCached = {
+    {1024, 1024, 256, 64}};
+const constexpr uint8_t kUnpooled = kNumClasses;
+// Blocks freed on a core other than their owner are returned in batches
+const constexpr size_t kRemoteBatch = 32;
+
+struct ClassPool {
+  // blocks owned by and cached on this core
+  BlockHeader* free;
+  size_t count;
+  // blocks owned by this core, returned by other cores
+  std::atomic<BlockHeader*> returned;
+  // blocks owned by remote_cpu, freed on this core and not yet returned
+  BlockHeader* remote_head;
+  BlockHeader* remote_tail;
+  size_t remote_count;
+  size_t remote_cpu;
+};
+
+struct alignas(ebbrt::cache_size) CorePool {
+  std::array<ClassPool, kNumClasses> classes;
+  // an event is spawned to return the partial batches
+  bool flush_pending;
+};
+
+// Zero initialized, so usable before any constructors run
+CorePool pools[ebbrt::Cpu::kMaxCpus];
+
+size_t BlockClass(size_t capacity) {
+  for (size_t i = 0; i < kNumClasses; ++i) {
+    if (capacity <= kBlockSizes[i] - kOverhead)
+      return i;
+  }
+  return kUnpooled;
+}
+
+void ReturnRemote(ClassPool& pool, size_t cls) {
+  // Hand the whole batch to the owner with a single CAS, the owner takes
+  // everything at once so there is no ABA to worry about
+  auto& returned = pools[pool.remote_cpu].classes[cls].returned;
+  auto head = returned.load(std::memory_order_relaxed);
+  do {
+    pool.remote_tail->next = head;
+  } while (!returned.compare_exchange_weak(head, pool.remote_head,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed));
+  pool.remote_head = nullptr;
+  pool.remote_tail = nullptr;
+  pool.remote_count = 0;
+}
+
+// Return the partial batches of this core, so blocks are not stranded here
+// while their owner falls back to the gp allocator
+void FlushRemote() {
+  auto& core = pools[ebbrt::Cpu::GetMine()];
+  core.flush_pending = false;
+  for (size_t cls = 0; cls < kNumClasses; ++cls) {
+    if (core.classes[cls].remote_count != 0)
+      ReturnRemote(core.classes[cls], cls);
+  }
+}
+
+BlockHeader* AllocBlock(size_t cls) {
+  auto cpu = static_cast<size_t>(ebbrt::Cpu::GetMine());
+  auto& pool = pools[cpu].classes[cls];
+  auto block = pool.free;
+  if (likely(block != nullptr)) {
+    pool.free = block->next;
+    --pool.count;
+    return block;
+  }
+
+  // Take back whatever other cores have freed
+  block = pool.returned.exchange(nullptr, std::memory_order_acquire);
+  if (block != nullptr) {
+    pool.free = block->next;
+    for (auto b = pool.free; b != nullptr; b = b->next) {
+      ++pool.count;
+    }
+    return block;
+  }
+
+  block = static_cast<BlockHeader*>(
+      ebbrt::gp_allocator->AllocNid(kBlockSizes[cls]));
+  if (unlikely(block == nullptr))
+    throw std::bad_alloc();
+
+  block->cpu = cpu;
+  block->cls = cls;
+  return block;
+}
+
+void FreeBlock(BlockHeader* block) {
+  auto cls = block->cls;
+  if (unlikely(cls == kUnpooled)) {
+    free(block);
+    return;
+  }
+
+  auto cpu = static_cast<size_t>(ebbrt::Cpu::GetMine());
+  auto& core = pools[cpu];
+  auto& pool = core.classes[cls];
+  if (likely(block->cpu == cpu)) {
+    if (unlikely(pool.count >= kMaxCached[cls])) {
+      ebbrt::gp_allocator->Free(block);
+      return;
+    }
+    block->next = pool.free;
+    pool.free = block;
+    ++pool.count;
+    return;
+  }
+
+  // Batch up frees for the same owner. A batch is returned when it fills,
+  // when a block with a different owner is freed here or, if it is still
+  // partial, once the current event is done.
+  if (pool.remote_count != 0 && pool.remote_cpu != block->cpu)
+    ReturnRemote(pool, cls);
+
+  block->next = pool.remote_head;
+  if (pool.remote_head == nullptr)
+    pool.remote_tail = block;
+  pool.remote_head = block;
+  pool.remote_cpu = block->cpu;
+  if (++pool.remote_count == kRemoteBatch) {
+    ReturnRemote(pool, cls);
+    return;
+  }
+
+  // Remote frees only happen once other cores run, so the event manager is up
+  if (!core.flush_pending) {
+    core.flush_pending = true;
+    ebbrt::event_manager->SpawnLocal(FlushRemote, /* force_async = */ true);
+  }
+}
+}  // namespace
+
+ebbrt::PooledIOBufOwner::PooledIOBufOwner(uint8_t* p, size_t capacity)
+    : ptr_(p), capacity_(capacity) {}
+
+const uint8_t* ebbrt::PooledIOBufOwner::Buffer() const { return ptr_; }
+
+size_t ebbrt::PooledIOBufOwner::Capacity() const { return capacity_; }
+
+void ebbrt::PooledIOBufOwner::operator delete(void* ptr) {
+  // ptr is the descriptor, the block header sits just before it
+  FreeBlock(reinterpret_cast<BlockHeader*>(static_cast<uint8_t*>(ptr) -
+                                           sizeof(BlockHeader)));
+}
+
+std::unique_ptr<ebbrt::MutPooledIOBuf>
+ebbrt::MakePooledIOBuf(size_t capacity, bool zero_memory) {
+  auto cls = BlockClass(capacity);
+  BlockHeader* block;
+  if (likely(cls != kUnpooled)) {
+    block = AllocBlock(cls);
+  } else {
+    block = static_cast<BlockHeader*>(malloc(kOverhead + capacity));
+    if (unlikely(block == nullptr))
+      throw std::bad_alloc();
+    block->cls = kUnpooled;
+  }
+
+  auto b = reinterpret_cast<uint8_t*>(block) + sizeof(BlockHeader);
+  auto buf = b + sizeof(MutPooledIOBuf);
+  if (zero_memory)
+    memset(buf, 0, capacity);
+
+  return std::unique_ptr<MutPooledIOBuf>(new (b) MutPooledIOBuf(buf, capacity));
+}
+
+std::unique_ptr<ebbrt::MutPooledIOBuf>
+ebbrt::MakePooledIOBufWithHeadroom(size_t headroom, size_t length,
+                                   bool zero_memory) {
+  auto buf = MakePooledIOBuf(headroom + length, zero_memory);
+  buf->Advance(headroom);
+  return buf;
+}
@@ -4,6 +4,7 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 #include <ebbrt/SlabAllocator.h>
 
+#include <algorithm>
 #include <mutex>
 
 #include <boost/container/static_vector.hpp>
@@ -43,6 +44,13 @@ size_t CalculateOrder(size_t size) {
   if (order <= 1)
     return order;
 
+  // Objects that are not a power of two in size (e.g. the intermediate gp
+  // allocator classes) would waste most of a minimally sized slab, so prefer a
+  // larger slab when it keeps the waste to an eighth
+  order = SlabOrder(size, ebbrt::PageAllocator::kMaxOrder, 8);
+  if (order <= ebbrt::PageAllocator::kMaxOrder)
+    return order;
+
   order = SlabOrder(size, ebbrt::PageAllocator::kMaxOrder, 0);
   ebbrt::kbugon(order > ebbrt::PageAllocator::kMaxOrder,
                 "Request for too big a slab\n");
@@ -130,7 +138,7 @@ void ebbrt::slab::Init() {
 }
 
 ebbrt::SlabCache::SlabCache(SlabAllocatorRoot& root)
-    : root_(root), remote_check(false) {}
+    : root_(root), remote_check(false), next_color_(0) {}
 ebbrt::SlabCache::~SlabCache() {
   kassert(object_list_.empty());
   kassert(remote_.list.empty());
@@ -194,9 +202,10 @@ void ebbrt::SlabCache::AddSlab(Pfn pfn) {
   page_slab_data.list.construct();
   page_slab_data.used = 0;
 
-  // Initialize free list
-  auto start = pfn.ToAddr();
-  auto end = pfn.ToAddr() + root_.NumObjectsPerSlab() * root_.size();
+  // Initialize free list, starting at this slab's color
+  auto start = pfn.ToAddr() + next_color_ * root_.color_step();
+  auto end = start + root_.NumObjectsPerSlab() * root_.size();
+  next_color_ = (next_color_ + 1) % root_.num_colors();
   for (uintptr_t addr = start; addr < end; addr += root_.size()) {
     // add object to per slab free list
     auto object = new (reinterpret_cast<void*>(addr)) FreeObject();
@@ -292,7 +301,7 @@ ebbrt::SlabAllocator& ebbrt::SlabAllocator::HandleFault(EbbId id) {
 }
 
 ebbrt::SlabAllocator::SlabAllocator(SlabAllocatorRoot& root)
-    : cache_(root), remote_cache_(nullptr) {}
+    : cache_(root), remote_cache_(nullptr), remote_allocations_(0) {}
 
 void* ebbrt::SlabAllocator::operator new(size_t size, Nid nid) {
   kassert(size == sizeof(SlabAllocator));
@@ -319,9 +328,29 @@ void ebbrt::SlabAllocator::operator delete(void* p) {
 }
 
 void* ebbrt::SlabAllocator::Alloc() {
+  auto ret = AllocLocal();
+  if (unlikely(ret == nullptr))
+    ret = AllocFallback(Cpu::GetMyNode());
+  return ret;
+}
+
+void* ebbrt::SlabAllocator::AllocNid(Nid nid) {
+  void* ret;
+  if (nid == Cpu::GetMyNode()) {
+    ret = AllocLocal();
+  } else {
+    ret = cache_.root_.GetNodeAllocator(nid).Alloc();
+  }
+  if (unlikely(ret == nullptr))
+    ret = AllocFallback(nid);
+  return ret;
+}
+
+void* ebbrt::SlabAllocator::AllocLocal() {
   auto ret = cache_.Alloc();
   if (unlikely(ret == nullptr)) {
-    auto pfn = page_allocator->Alloc(cache_.root_.order(), Cpu::GetMyNode());
+    auto pfn = page_allocator->AllocNoFallback(cache_.root_.order(),
+                                               Cpu::GetMyNode());
     if (pfn == Pfn::None())
       return nullptr;
     cache_.AddSlab(pfn);
@@ -331,22 +360,26 @@ void* ebbrt::SlabAllocator::Alloc() {
   return ret;
 }
 
-void* ebbrt::SlabAllocator::AllocNid(Nid nid) {
-  if (nid == Cpu::GetMyNode()) {
-    auto ret = cache_.Alloc();
-    if (ret == nullptr) {
-      auto pfn = page_allocator->Alloc(cache_.root_.order(), nid);
-      if (pfn == Pfn::None())
-        return nullptr;
-      cache_.AddSlab(pfn);
-      ret = cache_.Alloc();
-      kassert(ret != nullptr);
+// nid has run out of memory, try the other nodes in order of distance. Slabs
+// are only ever added to a cache of the node their pages belong to, so the
+// allocation goes through that node's cache.
+void* ebbrt::SlabAllocator::AllocFallback(Nid nid) {
+  auto my_node = Cpu::GetMyNode();
+  for (const auto& fallback : numa::FallbackOrder(nid)) {
+    if (fallback == nid)
+      continue;
+    void* ret;
+    if (fallback == my_node) {
+      ret = AllocLocal();
+    } else {
+      ret = cache_.root_.GetNodeAllocator(fallback).Alloc();
+    }
+    if (ret != nullptr) {
+      ++remote_allocations_;
+      return ret;
     }
-    return ret;
   }
-
-  auto& node_allocator = cache_.root_.GetNodeAllocator(nid);
-  return node_allocator.Alloc();
+  return nullptr;
 }
 
 void ebbrt::SlabAllocator::Free(void* p) {
@@ -429,7 +462,7 @@ void* ebbrt::SlabAllocatorNode::Alloc() {
   std::lock_guard<SpinLock> lock(lock_);
   auto ret = cache_.Alloc();
   if (ret == nullptr) {
-    auto pfn = page_allocator->Alloc(cache_.root_.order(), nid_);
+    auto pfn = page_allocator->AllocNoFallback(cache_.root_.order(), nid_);
     if (pfn == Pfn::None())
       return nullptr;
     cache_.AddSlab(pfn);
@@ -439,11 +472,20 @@ void* ebbrt::SlabAllocatorNode::Alloc() {
   return ret;
 }
 
-ebbrt::SlabAllocatorRoot::SlabAllocatorRoot(size_t size_in, size_t align_in)
+ebbrt::SlabAllocatorRoot::SlabAllocatorRoot(size_t size_in, size_t align_in,
+                                            bool coloring)
     : align_(align::Up(std::max(align_in, sizeof(void*)), sizeof(void*))),
       size_(align::Up(std::max(size_in, sizeof(void*)), align_)),
       order_(CalculateOrder(size_)), free_batch_(CalculateFreebatch(size_)),
-      hiwater_(free_batch_ * 4) {
+      hiwater_(free_batch_ * 4),
+      // Step by at least a cache line, and by the largest power of two
+      // dividing the size so that objects keep any alignment the size implies
+      color_step_(std::max({align_, cache_size, size_ & -size_})),
+      num_colors_(1) {
+  if (coloring) {
+    auto slack = (pmem::kPageSize << order_) - NumObjectsPerSlab() * size_;
+    num_colors_ = slack / color_step_ + 1;
+  }
   std::fill(node_allocators_.begin(), node_allocators_.end(), nullptr);
   std::fill(cpu_allocators_.begin(), cpu_allocators_.end(), nullptr);
 }
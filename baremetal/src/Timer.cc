@@ -16,8 +16,9 @@ ebbrt::Timer::Timer() {
     while (!timers_.empty() && timers_.begin()->fire_time_ <= now) {
       auto& hook = *timers_.begin();
 
-      // remove from the set
-      timers_.erase(hook);
+      // remove from the set, erasing by value would also remove any other
+      // hook due at the same time
+      timers_.erase(timers_.iterator_to(hook));
 
       // If it needs repeating, put it back in with the updated time
       if (hook.repeat_us_ != std::chrono::microseconds::zero()) {
@@ -101,7 +102,7 @@ void ebbrt::Timer::Start(Hook& hook, std::chrono::microseconds timeout,
 }
 
 void ebbrt::Timer::Stop(Hook& hook) {
-  timers_.erase(hook);
+  timers_.erase(timers_.iterator_to(hook));
 
   if (timers_.empty()) {
     StopTimer();
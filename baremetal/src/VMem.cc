@@ -8,18 +8,84 @@
 #include <cinttypes>
 #include <cstdint>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include <ebbrt/Align.h>
 #include <ebbrt/CpuAsm.h>
 #include <ebbrt/Debug.h>
 #include <ebbrt/E820.h>
 #include <ebbrt/EarlyPageAllocator.h>
+#include <ebbrt/EventManager.h>
 #include <ebbrt/PageAllocator.h>
+#include <ebbrt/VMemAllocator.h>
 
 namespace {
 ebbrt::ExplicitlyConstructed<ebbrt::vmem::Pte> page_table_root;
+
+// An unmapped region waiting on the other cores to flush their TLBs before
+// its memory and virtual addresses can be reused
+struct TlbShootdown {
+  TlbShootdown(ebbrt::Pfn vfn, size_t npages, std::function<void()> done)
+      : vfn(vfn), npages(npages), step(ebbrt::vmem::kLargePageSize),
+        done(std::move(done)) {}
+
+  void Invalidate() {
+    auto vaddr = vfn.ToAddr();
+    auto end = vaddr + npages * ebbrt::pmem::kPageSize;
+    for (auto addr = vaddr; addr < end; addr += step) {
+      asm volatile("invlpg (%[addr])" : : [addr] "r"(addr) : "memory");
+    }
+  }
+
+  void Reclaim() {
+    for (auto& page : pages) {
+      ebbrt::page_allocator->Free(page.first, page.second);
+    }
+    done();
+  }
+
+  ebbrt::Pfn vfn;
+  size_t npages;
+  // distance between the translations to invalidate
+  size_t step;
+  // pages to free and their order
+  std::vector<std::pair<ebbrt::Pfn, size_t>> pages;
+  std::function<void()> done;
+  std::atomic<size_t> remaining;
+};
+
+// The lower levels of the page table are shared, so clearing entries unmaps
+// a region everywhere. Other cores may still cache the old translations, so
+// each one flushes the range and the last one to do so hands the memory back.
+void Shootdown(std::shared_ptr<TlbShootdown> shootdown) {
+  auto ncpus = ebbrt::Cpu::Count();
+  if (ncpus == 1) {
+    shootdown->Reclaim();
+    return;
+  }
+  shootdown->remaining = ncpus - 1;
+  size_t mycpu = ebbrt::Cpu::GetMine();
+  for (size_t i = 0; i < ncpus; ++i) {
+    if (i == mycpu)
+      continue;
+    ebbrt::event_manager->SpawnRemote(
+        [shootdown]() {
+          shootdown->Invalidate();
+          if (shootdown->remaining.fetch_sub(1) == 1)
+            shootdown->Reclaim();
+        },
+        i);
+  }
 }
 
+void InvalidatePage(uint64_t addr) {
+  asm volatile("invlpg (%[addr])" : : [addr] "r"(addr) : "memory");
+}
+}  // namespace
+
 void ebbrt::vmem::Init() { page_table_root.construct(); }
 
 void ebbrt::vmem::EarlyMapMemory(uint64_t addr, uint64_t length) {
@@ -82,11 +148,122 @@ void ebbrt::vmem::MapMemory(Pfn vfn, Pfn pfn, uint64_t length) {
                       kbugon(page == Pfn::None());
                       auto page_addr = page.ToAddr();
                       new (reinterpret_cast<void*>(page_addr)) Pte[512];
+                      Pte table;
+                      table.SetNormal(page_addr);
+                      // page faults on different cores are not serialized
+                      if (!entry.SetIfNotPresent(table))
+                        page_allocator->Free(page);
+                      return true;
+                    });
+}
+
+void ebbrt::vmem::MapTopLevel(Pfn vfn, size_t npages) {
+  auto pte_root = Pte(ReadCr3());
+  auto pml4 = reinterpret_cast<Pte*>(pte_root.Addr(false));
+  auto vaddr = vfn.ToAddr();
+  auto idx_end = PtIndex(vaddr + npages * pmem::kPageSize - 1, 3);
+  for (auto idx = PtIndex(vaddr, 3); idx <= idx_end; ++idx) {
+    if (pml4[idx].Present())
+      continue;
+    auto page = page_allocator->Alloc();
+    kbugon(page == Pfn::None(), "Failed to allocate page table page\n");
+    auto page_addr = page.ToAddr();
+    new (reinterpret_cast<void*>(page_addr)) Pte[512];
+    pml4[idx].SetNormal(page_addr);
+  }
+}
+
+void ebbrt::vmem::MapLargePages(Pfn vfn, size_t npages) {
+  auto pte_root = Pte(ReadCr3());
+  auto vaddr = vfn.ToAddr();
+  TraversePageTable(pte_root, vaddr, vaddr + npages * pmem::kPageSize, 0, 4,
+                    [](Pte& entry, uint64_t base_virt, size_t level) {
+                      kassert(!entry.Present() && level == 1);
+                      auto pfn = page_allocator->Alloc(kLargePageOrder);
+                      kbugon(pfn == Pfn::None(),
+                             "Failed to allocate large page\n");
+                      entry.SetLarge(pfn.ToAddr());
+                      std::atomic_thread_fence(std::memory_order_release);
+                    },
+                    [](Pte& entry) {
+                      auto page = page_allocator->Alloc();
+                      kbugon(page == Pfn::None(),
+                             "Failed to allocate page table page\n");
+                      auto page_addr = page.ToAddr();
+                      new (reinterpret_cast<void*>(page_addr)) Pte[512];
                       entry.SetNormal(page_addr);
                       return true;
                     });
 }
 
+void ebbrt::vmem::UnmapLargePages(Pfn vfn, size_t npages) {
+  auto shootdown = std::make_shared<TlbShootdown>(
+      vfn, npages, [vfn]() { vmem_allocator->Free(vfn); });
+  shootdown->pages.reserve(npages >> kLargePageOrder);
+  auto pte_root = Pte(ReadCr3());
+  auto vaddr = vfn.ToAddr();
+  TraversePageTable(pte_root, vaddr, vaddr + npages * pmem::kPageSize, 0, 4,
+                    [&](Pte& entry, uint64_t base_virt, size_t level) {
+                      kassert(entry.Present() && level == 1);
+                      shootdown->pages.emplace_back(
+                          Pfn::Down(entry.Addr(true)), kLargePageOrder);
+                      entry.Clear();
+                      std::atomic_thread_fence(std::memory_order_release);
+                      InvalidatePage(base_virt);
+                    },
+                    [](Pte& entry) {
+                      kabort("Asked to unmap memory that wasn't mapped!\n");
+                      return false;
+                    });
+  Shootdown(std::move(shootdown));
+}
+
+void ebbrt::vmem::UnmapMemory(Pfn vfn, size_t npages,
+                              std::function<void()> done) {
+  auto shootdown = std::make_shared<TlbShootdown>(vfn, npages, std::move(done));
+  bool cleared = false;
+  auto pte_root = Pte(ReadCr3());
+  auto vaddr = vfn.ToAddr();
+  TraversePageTable(
+      pte_root, vaddr, vaddr + npages * pmem::kPageSize, 0, 4,
+      [&](Pte& entry, uint64_t base_virt, size_t level) {
+        if (!entry.Present())
+          return;
+        if (level == 0 || entry.Large()) {
+          entry.Clear();
+          std::atomic_thread_fence(std::memory_order_release);
+          InvalidatePage(base_virt);
+          cleared = true;
+          if (level == 0)
+            shootdown->step = pmem::kPageSize;
+          return;
+        }
+        // A table of small pages, all of which are in the range. The table
+        // goes too, so that the range can be mapped with large pages again.
+        auto table = entry.Addr(false);
+        auto pt = reinterpret_cast<Pte*>(table);
+        for (size_t i = 0; i < 512; ++i) {
+          if (pt[i].Present()) {
+            pt[i].Clear();
+            InvalidatePage(base_virt + i * pmem::kPageSize);
+          }
+        }
+        entry.Clear();
+        std::atomic_thread_fence(std::memory_order_release);
+        InvalidatePage(base_virt);
+        shootdown->pages.emplace_back(Pfn::Down(table), 0);
+        shootdown->step = pmem::kPageSize;
+        cleared = true;
+      },
+      [](Pte& entry) { return false; });
+
+  if (!cleared) {
+    shootdown->Reclaim();
+    return;
+  }
+  Shootdown(std::move(shootdown));
+}
+
 void ebbrt::vmem::EnableRuntimePageTable() {
   asm volatile("mov %[page_table], %%cr3"
                :
@@ -9,7 +9,9 @@
 
 #include <ebbrt/Align.h>
 #include <ebbrt/Cpu.h>
+#include <ebbrt/EventManager.h>
 #include <ebbrt/LocalIdMap.h>
+#include <ebbrt/VMem.h>
 
 namespace {
 uintptr_t ReadCr2() {
@@ -17,7 +19,37 @@ uintptr_t ReadCr2() {
   asm volatile("mov %%cr2, %[cr2]" : [cr2] "=r"(cr2));
   return cr2;
 }
+
+__attribute__((noreturn)) void NoFaultHandler(ebbrt::idt::ExceptionFrame* ef,
+                                              uintptr_t fault_addr) {
+  ebbrt::kprintf("Page fault for address %llx, no handler for it\n",
+                 fault_addr);
+  ebbrt::kprintf("SS: %#018" PRIx64 " RSP: %#018" PRIx64 "\n", ef->ss,
+                 ef->rsp);
+  ebbrt::kprintf("FLAGS: %#018" PRIx64 "\n",
+                 ef->rflags);  // TODO(Dschatz): print out actual meaning
+  ebbrt::kprintf("CS: %#018" PRIx64 " RIP: %#018" PRIx64 "\n", ef->cs,
+                 ef->rip);
+  ebbrt::kprintf("Error Code: %" PRIx64 "\n", ef->error_code);
+  ebbrt::kprintf("RAX: %#018" PRIx64 " RBX: %#018" PRIx64 "\n", ef->rax,
+                 ef->rbx);
+  ebbrt::kprintf("RCX: %#018" PRIx64 " RDX: %#018" PRIx64 "\n", ef->rcx,
+                 ef->rdx);
+  ebbrt::kprintf("RSI: %#018" PRIx64 " RDI: %#018" PRIx64 "\n", ef->rsi,
+                 ef->rdi);
+  ebbrt::kprintf("RBP: %#018" PRIx64 " R8:  %#018" PRIx64 "\n", ef->rbp,
+                 ef->r8);
+  ebbrt::kprintf("R9:  %#018" PRIx64 " R10: %#018" PRIx64 "\n", ef->r9,
+                 ef->r10);
+  ebbrt::kprintf("R11: %#018" PRIx64 " R12: %#018" PRIx64 "\n", ef->r11,
+                 ef->r12);
+  ebbrt::kprintf("R13: %#018" PRIx64 " R14: %#018" PRIx64 "\n", ef->r13,
+                 ef->r14);
+  ebbrt::kprintf("R15: %#018" PRIx64 "\n", ef->r15);
+  // TODO(dschatz): FPU
+  ebbrt::kabort();
 }
+}  // namespace
 
 void ebbrt::VMemAllocator::Init() {
   auto rep = new VMemAllocator;
@@ -36,15 +68,92 @@ ebbrt::VMemAllocator& ebbrt::VMemAllocator::HandleFault(EbbId id) {
   return ref;
 }
 
-ebbrt::VMemAllocator::VMemAllocator() {
+ebbrt::VMemAllocator::VMemAllocator() : next_chunk_(0) {
   regions_.emplace(std::piecewise_construct,
                    std::forward_as_tuple(Pfn::Up(0xFFFF800000000000)),
                    std::forward_as_tuple(Pfn::Down(trans::kVMemStart)));
+  for (auto& chunk : chunks_) {
+    chunk.store(nullptr, std::memory_order_relaxed);
+  }
+  arena_start_ =
+      AllocRegion(kMaxArenaChunks * kArenaChunkPages, kArenaChunkPages, nullptr);
+  // The secondary cores copy the top level of the page table when they boot,
+  // so populating it now keeps the arena mappings shared between all cores
+  vmem::MapTopLevel(arena_start_, kMaxArenaChunks * kArenaChunkPages);
 }
 
 ebbrt::Pfn
 ebbrt::VMemAllocator::Alloc(size_t npages,
                             std::unique_ptr<PageFaultHandler> pf_handler) {
+  auto cls = ArenaClass(npages, 1);
+  if (cls < kArenaClasses)
+    return AllocArena(npages, cls, std::move(pf_handler));
+  return AllocRegion(npages, std::move(pf_handler));
+}
+
+ebbrt::Pfn
+ebbrt::VMemAllocator::Alloc(size_t npages, size_t pages_align,
+                            std::unique_ptr<PageFaultHandler> pf_handler) {
+  auto cls = ArenaClass(npages, pages_align);
+  if (cls < kArenaClasses)
+    return AllocArena(npages, cls, std::move(pf_handler));
+  return AllocRegion(npages, pages_align, std::move(pf_handler));
+}
+
+size_t ebbrt::VMemAllocator::ArenaClass(size_t npages, size_t pages_align) {
+  // slots are aligned to their size
+  for (size_t cls = 0; cls < kArenaClasses; ++cls) {
+    if (npages <= SlotPages(cls) && SlotPages(cls) % pages_align == 0)
+      return cls;
+  }
+  return kArenaClasses;
+}
+
+ebbrt::Pfn
+ebbrt::VMemAllocator::AllocArena(size_t npages, size_t cls,
+                                 std::unique_ptr<PageFaultHandler> pf_handler) {
+  size_t mycpu = Cpu::GetMine();
+  auto& arena = arenas_[mycpu][cls];
+  auto chunk_slots = kArenaChunkPages / SlotPages(cls);
+  Pfn ret;
+  {
+    std::lock_guard<SpinLock> lock(arena.lock);
+    if (!arena.free_slots.empty()) {
+      ret = arena.free_slots.back();
+      arena.free_slots.pop_back();
+    } else {
+      if (arena.chunk == kMaxArenaChunks || arena.next_slot == chunk_slots) {
+        auto index = next_chunk_.fetch_add(1, std::memory_order_relaxed);
+        kbugon(index >= kMaxArenaChunks, "%s: out of arena chunks\n",
+               __PRETTY_FUNCTION__);
+        chunks_[index].store(new ArenaChunk(mycpu, cls),
+                             std::memory_order_release);
+        arena.chunk = index;
+        arena.next_slot = 0;
+      }
+      ret = arena_start_ + arena.chunk * kArenaChunkPages +
+            arena.next_slot * SlotPages(cls);
+      ++arena.next_slot;
+    }
+  }
+  auto& slot = FindChunk(ret)->Slot(ret - arena_start_);
+  kassert(slot.npages.load(std::memory_order_relaxed) == 0);
+  slot.npages.store(npages, std::memory_order_release);
+  // publish the handler last, the fault path relies on it to see npages
+  slot.handler.store(pf_handler.release(), std::memory_order_release);
+  return ret;
+}
+
+ebbrt::VMemAllocator::ArenaChunk* ebbrt::VMemAllocator::FindChunk(Pfn vfn) {
+  if (!InArena(vfn))
+    return nullptr;
+  auto offset = vfn - arena_start_;
+  return chunks_[offset / kArenaChunkPages].load(std::memory_order_acquire);
+}
+
+ebbrt::Pfn
+ebbrt::VMemAllocator::AllocRegion(size_t npages,
+                                  std::unique_ptr<PageFaultHandler> pf_handler) {
   std::lock_guard<SpinLock> lock(lock_);
   for (auto it = regions_.begin(); it != regions_.end(); ++it) {
     const auto& begin = it->first;
@@ -77,8 +186,8 @@ ebbrt::VMemAllocator::Alloc(size_t npages,
 }
 
 ebbrt::Pfn
-ebbrt::VMemAllocator::Alloc(size_t npages, size_t pages_align,
-                            std::unique_ptr<PageFaultHandler> pf_handler) {
+ebbrt::VMemAllocator::AllocRegion(size_t npages, size_t pages_align,
+                                  std::unique_ptr<PageFaultHandler> pf_handler) {
   std::lock_guard<SpinLock> lock(lock_);
   for (auto it = regions_.begin(); it != regions_.end(); ++it) {
     const auto& begin = it->first;
@@ -118,43 +227,112 @@ ebbrt::VMemAllocator::Alloc(size_t npages, size_t pages_align,
          npages);
 }
 
-void ebbrt::VMemAllocator::HandlePageFault(idt::ExceptionFrame* ef) {
+void ebbrt::VMemAllocator::Free(Pfn vfn) {
+  if (InArena(vfn)) {
+    auto chunk = FindChunk(vfn);
+    size_t offset = vfn - arena_start_;
+    kbugon(chunk == nullptr || chunk->SlotStart(offset) != offset ||
+               chunk->Slot(offset).npages.load(std::memory_order_acquire) ==
+                   0,
+           "%s: no allocated region at %llx\n", __PRETTY_FUNCTION__,
+           vfn.ToAddr());
+    auto& slot = chunk->Slot(offset);
+    auto handler = slot.handler.exchange(nullptr, std::memory_order_acq_rel);
+    slot.npages.store(0, std::memory_order_release);
+    if (handler != nullptr) {
+      // another core may be in the middle of a fault on this region
+      event_manager->DoRcu([handler]() { delete handler; });
+    }
+    // Whatever the region left mapped, such as an mmio bar, must not be
+    // inherited by the next region in the slot. The slot is reused once
+    // every core has flushed the old translations.
+    auto& arena = arenas_[chunk->cpu][chunk->cls];
+    vmem::UnmapMemory(vfn, chunk->slot_pages, [&arena, vfn]() {
+      std::lock_guard<SpinLock> lock(arena.lock);
+      arena.free_slots.emplace_back(vfn);
+    });
+    return;
+  }
+
+  std::lock_guard<SpinLock> lock(lock_);
+  auto it = regions_.find(vfn);
+  kbugon(it == regions_.end() || it->second.IsFree(),
+         "%s: no allocated region at %llx\n", __PRETTY_FUNCTION__,
+         vfn.ToAddr());
+  it->second.set_allocated(false);
+  it->second.set_page_fault_handler(nullptr);
+
+  // regions are sorted in descending order, so the region following this one
+  // in memory comes before it in the map
+  if (it != regions_.begin()) {
+    auto higher = std::prev(it);
+    if (higher->second.IsFree() && higher->first == it->second.end()) {
+      it->second.set_end(higher->second.end());
+      regions_.erase(higher);
+    }
+  }
+  auto lower = std::next(it);
+  if (lower != regions_.end() && lower->second.IsFree() &&
+      lower->second.end() == it->first) {
+    lower->second.set_end(it->second.end());
+    regions_.erase(it);
+  }
+}
+
+size_t ebbrt::VMemAllocator::RegionPages(Pfn vfn) {
+  if (InArena(vfn)) {
+    auto chunk = FindChunk(vfn);
+    size_t offset = vfn - arena_start_;
+    auto npages =
+        chunk == nullptr
+            ? 0
+            : chunk->Slot(offset).npages.load(std::memory_order_acquire);
+    kbugon(npages == 0 || chunk->SlotStart(offset) != offset,
+           "%s: no allocated region at %llx\n", __PRETTY_FUNCTION__,
+           vfn.ToAddr());
+    return npages;
+  }
+
   std::lock_guard<SpinLock> lock(lock_);
+  auto it = regions_.find(vfn);
+  kbugon(it == regions_.end() || it->second.IsFree(),
+         "%s: no allocated region at %llx\n", __PRETTY_FUNCTION__,
+         vfn.ToAddr());
+  return it->second.end() - it->first;
+}
+
+void ebbrt::VMemAllocator::HandlePageFault(idt::ExceptionFrame* ef) {
   auto fault_addr = ReadCr2();
 
   if (fault_addr >= trans::kVMemStart) {
     trans::HandleFault(ef, fault_addr);
-  } else {
-    auto it = regions_.lower_bound(Pfn::Down(fault_addr));
-    if (it == regions_.end() || it->second.end() < Pfn::Up(fault_addr)) {
-      kprintf("Page fault for address %llx, no handler for it\n", fault_addr);
-      ebbrt::kprintf("SS: %#018" PRIx64 " RSP: %#018" PRIx64 "\n", ef->ss,
-                     ef->rsp);
-      ebbrt::kprintf("FLAGS: %#018" PRIx64 "\n",
-                     ef->rflags);  // TODO(Dschatz): print out actual meaning
-      ebbrt::kprintf("CS: %#018" PRIx64 " RIP: %#018" PRIx64 "\n", ef->cs,
-                     ef->rip);
-      ebbrt::kprintf("Error Code: %" PRIx64 "\n", ef->error_code);
-      ebbrt::kprintf("RAX: %#018" PRIx64 " RBX: %#018" PRIx64 "\n", ef->rax,
-                     ef->rbx);
-      ebbrt::kprintf("RCX: %#018" PRIx64 " RDX: %#018" PRIx64 "\n", ef->rcx,
-                     ef->rdx);
-      ebbrt::kprintf("RSI: %#018" PRIx64 " RDI: %#018" PRIx64 "\n", ef->rsi,
-                     ef->rdi);
-      ebbrt::kprintf("RBP: %#018" PRIx64 " R8:  %#018" PRIx64 "\n", ef->rbp,
-                     ef->r8);
-      ebbrt::kprintf("R9:  %#018" PRIx64 " R10: %#018" PRIx64 "\n", ef->r9,
-                     ef->r10);
-      ebbrt::kprintf("R11: %#018" PRIx64 " R12: %#018" PRIx64 "\n", ef->r11,
-                     ef->r12);
-      ebbrt::kprintf("R13: %#018" PRIx64 " R14: %#018" PRIx64 "\n", ef->r13,
-                     ef->r14);
-      ebbrt::kprintf("R15: %#018" PRIx64 "\n", ef->r15);
-      // TODO(dschatz): FPU
-      kabort();
-    }
-    it->second.HandleFault(ef, fault_addr);
+    return;
+  }
+
+  auto vfn = Pfn::Down(fault_addr);
+  if (InArena(vfn)) {
+    auto chunk = FindChunk(vfn);
+    if (chunk == nullptr)
+      NoFaultHandler(ef, fault_addr);
+    size_t offset = vfn - arena_start_;
+    auto& slot = chunk->Slot(offset);
+    auto handler = slot.handler.load(std::memory_order_acquire);
+    // A handler seen here is kept alive by rcu even if the region is freed
+    // concurrently, in which case npages may read as 0 and the fault is
+    // reported
+    if (handler == nullptr ||
+        offset >= chunk->SlotStart(offset) +
+                      slot.npages.load(std::memory_order_acquire))
+      NoFaultHandler(ef, fault_addr);
+    handler->HandleFault(ef, fault_addr);
+    return;
   }
+
+  std::lock_guard<SpinLock> lock(lock_);
+  auto it = regions_.lower_bound(vfn);
+  if (it == regions_.end() || it->second.end() < Pfn::Up(fault_addr))
+    NoFaultHandler(ef, fault_addr);
+  it->second.HandleFault(ef, fault_addr);
 }
 
 extern "C" void ebbrt::idt::PageFaultException(ExceptionFrame* ef) {
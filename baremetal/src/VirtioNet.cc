@@ -4,10 +4,16 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 #include <ebbrt/VirtioNet.h>
 
+#include <algorithm>
+#include <mutex>
+
 #include <ebbrt/Debug.h>
 #include <ebbrt/EventManager.h>
+#include <ebbrt/NetChecksum.h>
+#include <ebbrt/PooledIOBuf.h>
 #include <ebbrt/StaticIOBuf.h>
 #include <ebbrt/UniqueIOBuf.h>
+#include <ebbrt/VMem.h>
 
 namespace {
 const constexpr uint32_t kCSum = 0;
@@ -41,8 +47,107 @@ struct VirtioNetCtrlMq {
 typedef uint8_t VirtioNetCtrlAck;
 const constexpr uint8_t kVirtioNetOk = 0;
 const constexpr uint8_t kVirtioNetErr = 1;
+
+// With mergeable receive buffers the device spreads large packets across
+// several buffers, so each one need only be a page
+const constexpr size_t kRxBufferSize =
+    ebbrt::PooledIOBufCapacity(ebbrt::pmem::kPageSize);
+
+// Core to process a received packet on when steering. Packets of a TCP or
+// UDP flow are hashed by their ports and addresses, so a flow is always
+// processed by the same core. Anything else stays on the receiving core.
+size_t SteerCpu(const ebbrt::MutIOBuf& buf, size_t mine, size_t ncpus) {
+  const auto kIpOffset = sizeof(ebbrt::EthernetHeader);
+  if (buf.Length() < kIpOffset + sizeof(ebbrt::Ipv4Header))
+    return mine;
+
+  auto eth = reinterpret_cast<const ebbrt::EthernetHeader*>(buf.Data());
+  auto ip = reinterpret_cast<const ebbrt::Ipv4Header*>(buf.Data() + kIpOffset);
+  if (eth->type != ebbrt::htons(ebbrt::kEthTypeIp) ||
+      (ip->proto != ebbrt::kIpProtoTCP && ip->proto != ebbrt::kIpProtoUDP))
+    return mine;
+
+  uint64_t hash = static_cast<uint64_t>(ip->src.toU32()) << 32 |
+                  ip->dst.toU32();
+  // Only the first fragment has the ports, keep all of them together
+  auto ports_offset = kIpOffset + ip->HeaderLength();
+  if (!ip->Fragmented() && buf.Length() >= ports_offset + 4) {
+    uint32_t ports;
+    memcpy(&ports, buf.Data() + ports_offset, sizeof(ports));
+    hash ^= ports;
+  }
+  // multiplicative hashing, the high bits are well mixed
+  hash *= 0x9e3779b97f4a7c15ull;
+  return (hash >> 32) % ncpus;
+}
+
+// Whether the device can be given the chain's buffers by address. Large gp
+// allocations and stacks live in vmem, which is not identity mapped.
+bool DeviceAddressable(const ebbrt::IOBuf& buf) {
+  for (auto& b : buf) {
+    if (!ebbrt::vmem::IdentityMapped(b.Data()))
+      return false;
+  }
+  return true;
+}
 }  // namespace
 
+const ebbrt::VirtioNetDriver::PollConfig
+    ebbrt::VirtioNetDriver::kDefaultPollConfig = {
+#ifdef VIRTIO_NET_POLL
+        PollConfig::kPoll,
+#else
+        PollConfig::kAdaptive,
+#endif
+        /* busy_packets = */ 16,
+        /* idle_timeout = */ std::chrono::microseconds(50)};
+
+std::atomic<const ebbrt::VirtioNetDriver::PollConfig*>
+    ebbrt::VirtioNetDriver::shared_poll_config_;
+
+std::array<std::atomic<const ebbrt::VirtioNetDriver::PollConfig*>,
+           ebbrt::Cpu::kMaxCpus>
+    ebbrt::VirtioNetDriver::poll_configs_;
+
+namespace {
+void RetirePollConfig(const ebbrt::VirtioNetDriver::PollConfig* old) {
+  if (old != nullptr)
+    ebbrt::event_manager->DoRcu([old]() { delete old; });
+}
+}  // namespace
+
+void ebbrt::VirtioNetDriver::SetPollConfig(const PollConfig& config,
+                                           size_t queue) {
+  if (queue != kAllQueues) {
+    kassert(queue < poll_configs_.size());
+    RetirePollConfig(poll_configs_[queue].exchange(
+        new PollConfig(config), std::memory_order_acq_rel));
+    return;
+  }
+  // One copy shared by every queue. Dropping the per queue ones makes them
+  // all fall back to it.
+  RetirePollConfig(shared_poll_config_.exchange(new PollConfig(config),
+                                                std::memory_order_acq_rel));
+  for (auto& queue_config : poll_configs_) {
+    if (queue_config.load(std::memory_order_relaxed) != nullptr)
+      RetirePollConfig(
+          queue_config.exchange(nullptr, std::memory_order_acq_rel));
+  }
+}
+
+ebbrt::VirtioNetDriver::PollConfig
+ebbrt::VirtioNetDriver::GetPollConfig(size_t queue) {
+  return PollConfigOf(queue);
+}
+
+const ebbrt::VirtioNetDriver::PollConfig&
+ebbrt::VirtioNetDriver::PollConfigOf(size_t queue) {
+  auto config = poll_configs_[queue].load(std::memory_order_acquire);
+  if (config == nullptr)
+    config = shared_poll_config_.load(std::memory_order_acquire);
+  return config != nullptr ? *config : kDefaultPollConfig;
+}
+
 void ebbrt::VirtioNetDriver::Create(pci::Device& dev) {
   auto virt_dev = new VirtioNetDriver(dev);
   virt_dev->ebb_ =
@@ -65,13 +170,24 @@ ebbrt::VirtioNetDriver::VirtioNetDriver(pci::Device& dev)
   kbugon(!csum, "Device missing checksum offloading support!\n");
   auto tso4 = features & (1 << kHostTso4);
   kbugon(!tso4, "Device missing tcp segmentation offload support\n");
+  auto mrg_rxbuf = features & (1 << kMrgRxbuf);
+  kbugon(!mrg_rxbuf, "Device missing mergeable receive buffer support\n");
+  auto indirect = features & (1 << kVirtioRingIndirectDesc);
 
   // Figure out max queue pairs supported
   auto max_queue_pairs = DeviceConfigRead16(8);
   auto num_cores = Cpu::Count();
-  // We map a queue pair to each core, so assert that there are enough
-  kassert(max_queue_pairs >= num_cores);
-  size_t used_queue_pairs = num_cores;
+  // We map a queue pair to each core if there are enough. A core owns at
+  // most one, so queue pairs beyond the number of cores are left unused.
+  size_t used_queue_pairs = std::min<size_t>(max_queue_pairs, num_cores);
+#ifdef VIRTIO_NET_MAX_QUEUE_PAIRS
+  used_queue_pairs =
+      std::min<size_t>(used_queue_pairs, VIRTIO_NET_MAX_QUEUE_PAIRS);
+#endif
+  num_queue_pairs_ = used_queue_pairs;
+  for (size_t i = 0; i < num_queue_pairs_; ++i) {
+    tx_backlogs_.emplace_back(new TxBacklog());
+  }
   SetNumQueues(max_queue_pairs * 2 + 1);
 
   // Tell the device how many queues we will use
@@ -111,10 +227,14 @@ ebbrt::VirtioNetDriver::VirtioNetDriver(pci::Device& dev)
 
   auto rcv_vector =
       event_manager->AllocateVector([this]() { ebb_->Receive(); });
+  auto snd_vector =
+      event_manager->AllocateVector([this]() { ebb_->SendComplete(); });
 
   for (size_t i = 0; i < used_queue_pairs; ++i) {
     auto& rcv_queue = InitializeQueue(i * 2, Cpu::GetByIndex(i)->nid());
     auto& snd_queue = InitializeQueue(i * 2 + 1, Cpu::GetByIndex(i)->nid());
+    if (indirect)
+      snd_queue.EnableIndirectDescriptors();
 
     // Fill receive queue
     auto num_bufs = rcv_queue.num_free_descriptors();
@@ -122,17 +242,17 @@ ebbrt::VirtioNetDriver::VirtioNetDriver(pci::Device& dev)
     bufs.reserve(num_bufs);
 
     for (size_t i = 0; i < num_bufs; ++i) {
-      bufs.emplace_back(MakeUniqueIOBuf(65562));
+      bufs.emplace_back(MakePooledIOBuf(kRxBufferSize));
     }
 
     auto it = rcv_queue.AddWritableBuffers(bufs.begin(), bufs.end());
     kassert(it == bufs.end());
 
     dev.SetMsixEntry(i * 2, rcv_vector, i);
-    // We disable the interrupt on packets being sent because we clear everytime
-    // send() gets called. Additionally the device will interrupt us if the
-    // queue
-    // is empty (so we will clear in some bounded time)
+    dev.SetMsixEntry(i * 2 + 1, snd_vector, i);
+    // Sent buffers are cleared on every send, so the send interrupt is only
+    // enabled while packets are backlogged waiting for the device to free
+    // descriptors
     snd_queue.DisableInterrupts();
   }
 
@@ -152,54 +272,179 @@ void ebbrt::VirtioNetDriver::Start() {
   AddDeviceStatus(kConfigDriverOk);
 }
 
-uint32_t ebbrt::VirtioNetDriver::GetDriverFeatures() {
+uint64_t ebbrt::VirtioNetDriver::GetDriverFeatures() {
   return 1 << kCSum | 1 << kGuestCSum | 1 << kMac | 1 << kGuestTso4 |
          1 << kGuestUfo | 1 << kHostTso4 | 1 << kHostUfo | 1 << kMrgRxbuf |
-         1 << kCtrlVq | 1 << kMq;
+         1 << kCtrlVq | 1 << kMq | 1 << kVirtioRingIndirectDesc |
+         1 << kVirtioRingEventIdx | 1ull << kVirtioRingPacked;
 }
 
 ebbrt::VirtioNetRep::VirtioNetRep(const VirtioNetDriver& root)
-    : root_(root), rcv_queue_(root_.GetQueue(Cpu::GetMine() * 2)),
-      snd_queue_(root_.GetQueue(Cpu::GetMine() * 2 + 1)),
-      receive_callback_([this]() { ReceivePoll(); }), circ_buffer_head_(0),
-      circ_buffer_tail_(0) {}
+    : root_(root), rcv_queue_(nullptr),
+      snd_queue_(
+          root_.GetQueue(Cpu::GetMine() % root_.num_queue_pairs_ * 2 + 1)),
+      snd_backlog_(
+          *root_.tx_backlogs_[Cpu::GetMine() % root_.num_queue_pairs_]),
+      snd_lock_(nullptr), receive_callback_([this]() { ReceivePoll(); }),
+      rx_polling_(false), rx_partial_remaining_(0), gro_(root_.itf_) {
+  size_t mine = Cpu::GetMine();
+  if (mine < root_.num_queue_pairs_) {
+    rcv_queue_ = &root_.GetQueue(mine * 2);
+    rx_batch_.reserve(kRxBudget);
+  }
+  if (root_.num_queue_pairs_ < Cpu::Count()) {
+    snd_lock_ = &snd_backlog_.lock;
+    steer_batches_.resize(Cpu::Count());
+  }
+}
 
-void ebbrt::VirtioNetDriver::Send(std::unique_ptr<IOBuf> buf,
+void ebbrt::VirtioNetDriver::Send(std::unique_ptr<MutIOBuf> buf,
                                   PacketInfo pinfo) {
   ebb_->Send(std::move(buf), std::move(pinfo));
 }
 
-void ebbrt::VirtioNetRep::Send(std::unique_ptr<IOBuf> buf, PacketInfo pinfo) {
-  std::unique_ptr<MutUniqueIOBuf> b;
+bool ebbrt::VirtioNetDriver::SendCongested() { return ebb_->SendCongested(); }
+
+void ebbrt::VirtioNetDriver::SendFlush() { ebb_->SendFlush(); }
+
+void ebbrt::VirtioNetRep::Send(std::unique_ptr<MutIOBuf> buf,
+                               PacketInfo pinfo) {
+  if (likely(snd_lock_ == nullptr)) {
+    BacklogSend(std::move(buf), std::move(pinfo));
+    return;
+  }
+  std::lock_guard<SpinLock> lock(*snd_lock_);
+  BacklogSend(std::move(buf), std::move(pinfo));
+}
+
+bool ebbrt::VirtioNetRep::SendCongested() {
+  return snd_backlog_.congested.load(std::memory_order_relaxed);
+}
+
+void ebbrt::VirtioNetRep::SendFlush() {
+  if (likely(snd_lock_ == nullptr)) {
+    snd_queue_.Flush();
+    return;
+  }
+  std::lock_guard<SpinLock> lock(*snd_lock_);
+  snd_queue_.Flush();
+}
+
+void ebbrt::VirtioNetRep::SendComplete() {
+  if (likely(snd_lock_ == nullptr)) {
+    DrainBacklog();
+    return;
+  }
+  std::lock_guard<SpinLock> lock(*snd_lock_);
+  DrainBacklog();
+}
 
+// Queue the packet for the device, or if the send queue is full keep it in
+// the backlog behind the packets already waiting
+void ebbrt::VirtioNetRep::BacklogSend(std::unique_ptr<MutIOBuf> buf,
+                                      PacketInfo pinfo) {
   snd_queue_.ClearUsedBuffers();
+  auto& backlog = snd_backlog_.packets;
+  if (likely(backlog.empty() && snd_queue_.num_free_descriptors() > 0)) {
+    QueueSend(std::move(buf), std::move(pinfo));
+    return;
+  }
+
+  if (backlog.size() >= kTxBacklog) {
+    ++tx_stats_.dropped;
+    return;
+  }
+  backlog.emplace_back(std::move(buf), std::move(pinfo));
+  ++tx_stats_.backlogged;
+  tx_stats_.backlog_max =
+      std::max<uint64_t>(tx_stats_.backlog_max, backlog.size());
+  if (backlog.size() >= kTxBacklogHigh &&
+      !snd_backlog_.congested.load(std::memory_order_relaxed)) {
+    snd_backlog_.congested.store(true, std::memory_order_relaxed);
+    ++tx_stats_.congested;
+  }
+  DrainBacklog();
+}
+
+// Move backlogged packets into the send queue as the device frees
+// descriptors. The send interrupt is left enabled until the backlog is empty.
+void ebbrt::VirtioNetRep::DrainBacklog() {
+  auto& backlog = snd_backlog_.packets;
+  while (true) {
+    snd_queue_.ClearUsedBuffers();
+    while (!backlog.empty() && snd_queue_.num_free_descriptors() > 0) {
+      auto& packet = backlog.front();
+      // The device is notified once, after the last packet
+      packet.second.flags |= PacketInfo::kMore;
+      QueueSend(std::move(packet.first), std::move(packet.second));
+      backlog.pop_front();
+    }
+    snd_queue_.Flush();
+    if (backlog.size() <= kTxBacklogLow)
+      snd_backlog_.congested.store(false, std::memory_order_relaxed);
+
+    if (backlog.empty()) {
+      snd_queue_.DisableInterrupts();
+      return;
+    }
+    // Check for descriptors freed before the interrupt was enabled, whose
+    // interrupt would be missed
+    snd_queue_.EnableInterrupts();
+    if (!snd_queue_.HasUsedBuffer())
+      return;
+  }
+}
+
+void ebbrt::VirtioNetRep::QueueSend(std::unique_ptr<MutIOBuf> buf,
+                                    PacketInfo pinfo) {
+  std::unique_ptr<MutIOBuf> b;
+
   VirtioNetHeader* header;
   auto free_desc = snd_queue_.num_free_descriptors();
-#ifdef VIRTIO_ZERO_COPY
-  if (free_desc > buf->CountChainElements()) {
-    // we have enough descriptors to avoid a copy
-    b = MakeUniqueIOBuf(sizeof(VirtioNetHeader), /* zero_memory = */ true);
-    header = reinterpret_cast<VirtioNetHeader*>(b->MutData());
-    b->PrependChain(std::move(buf));
-  } else  // NOLINT
-#endif
-      if (free_desc >= 1) {
-    // XXX: Maybe we should use indirect descriptors instead?
-    // copy into one buffer
-    auto len = buf->ComputeChainDataLength();
-    b = MakeUniqueIOBuf(len + sizeof(VirtioNetHeader));
-    memset(b->MutData(), 0, sizeof(VirtioNetHeader));
-    header = reinterpret_cast<VirtioNetHeader*>(b->MutData());
-    auto data = b->MutData() + sizeof(VirtioNetHeader);
-    for (auto& buf_it : *buf) {
-      memcpy(data, buf_it.Data(), buf_it.Length());
-      data += buf_it.Length();
+  // The chain is sent in place, with our header in the headroom the stack
+  // left or in a buffer of its own. The queue owns the chain until the device
+  // is done with it, so the data stays valid without a copy.
+  auto in_place = buf->Headroom() >= sizeof(VirtioNetHeader);
+  auto elements = buf->CountChainElements() + (in_place ? 0 : 1);
+  if (snd_queue_.DescriptorsNeeded(elements) <= free_desc &&
+      DeviceAddressable(*buf)) {
+    if (in_place) {
+      header = reinterpret_cast<VirtioNetHeader*>(
+          buf->Prepend(sizeof(VirtioNetHeader)));
+      memset(header, 0, sizeof(VirtioNetHeader));
+      b = std::move(buf);
+    } else {
+      b = MakePooledIOBuf(sizeof(VirtioNetHeader), /* zero_memory = */ true);
+      header = reinterpret_cast<VirtioNetHeader*>(b->MutData());
+      b->PrependChain(std::move(buf));
     }
   } else {
-    kprintf("Drop\n");
-    // kick to make it process more buffers, drop the send
-    snd_queue_.Kick();
-    return;
+    // The chain is too long for the free descriptors, or has memory the
+    // device cannot address, copy into one buffer
+    kassert(free_desc >= 1);
+    auto len = buf->ComputeChainDataLength();
+    auto copy = MakePooledIOBuf(len + sizeof(VirtioNetHeader));
+    memset(copy->MutData(), 0, sizeof(VirtioNetHeader));
+    header = reinterpret_cast<VirtioNetHeader*>(copy->MutData());
+    auto data = copy->MutData() + sizeof(VirtioNetHeader);
+    if ((pinfo.flags & PacketInfo::kNeedsCsum) &&
+        pinfo.gso_type == PacketInfo::kGsoNone) {
+      // The data is read anyway, so complete the checksum during the copy
+      // rather than have the device read it again
+      auto csum = IpCsumCopy(data, *buf, pinfo.csum_start);
+      // 0 and 0xffff are the same in one's complement, but a zero udp
+      // checksum means none was computed
+      if (csum == 0)
+        csum = 0xffff;
+      memcpy(data + pinfo.csum_start + pinfo.csum_offset, &csum, sizeof(csum));
+      pinfo.flags &= ~PacketInfo::kNeedsCsum;
+    } else {
+      for (auto& buf_it : *buf) {
+        memcpy(data, buf_it.Data(), buf_it.Length());
+        data += buf_it.Length();
+      }
+    }
+    b = std::move(copy);
   }
 
   kassert(header != nullptr);
@@ -213,8 +458,16 @@ void ebbrt::VirtioNetRep::Send(std::unique_ptr<IOBuf> buf, PacketInfo pinfo) {
     header->hdr_len = pinfo.hdr_len;
     header->gso_size = pinfo.gso_size;
   }
-  auto elements = b->CountChainElements();
-  snd_queue_.AddBuffer(std::move(b), elements);
+  ++tx_stats_.packets;
+  tx_stats_.bytes += b->ComputeChainDataLength() - sizeof(VirtioNetHeader);
+  auto out_num = b->CountChainElements();
+  snd_queue_.AddBuffer(std::move(b), out_num, pinfo.flags & PacketInfo::kMore);
+}
+
+ebbrt::VirtioNetRep::TxStats ebbrt::VirtioNetRep::GetTxStats() const {
+  auto stats = tx_stats_;
+  stats.notifications = snd_queue_.NumKicks();
+  return stats;
 }
 
 const ebbrt::EthernetAddress& ebbrt::VirtioNetDriver::GetMacAddress() {
@@ -222,66 +475,161 @@ const ebbrt::EthernetAddress& ebbrt::VirtioNetDriver::GetMacAddress() {
 }
 
 void ebbrt::VirtioNetRep::Receive() {
-  rcv_queue_.DisableInterrupts();
+  rcv_queue_->DisableInterrupts();
   receive_callback_.Start();
 }
 
+void ebbrt::VirtioNetRep::ReceiveBuffer(std::unique_ptr<MutIOBuf> buf) {
+  // A packet may span several buffers, the header in the first one says how
+  // many. Chain them together before delivering the packet.
+  if (!rx_partial_) {
+    auto header = reinterpret_cast<VirtioNetHeader*>(buf->MutData());
+    if (unlikely(header->num_buffers == 0)) {
+      ++rx_stats_.dropped;
+      return;
+    }
+    rx_partial_remaining_ = header->num_buffers - 1;
+    // A partial checksum means the packet came from a local sender and
+    // never had a checksum to get wrong
+    rx_partial_info_.flags = 0;
+    if (header->flags &
+        (VirtioNetHeader::kDataValid | VirtioNetHeader::kNeedsCsum))
+      rx_partial_info_.flags |= RxInfo::kCsumValid;
+    buf->Advance(sizeof(VirtioNetHeader));
+    rx_partial_ = std::move(buf);
+  } else {
+    --rx_partial_remaining_;
+    rx_partial_->PrependChain(std::move(buf));
+  }
+  if (rx_partial_remaining_ > 0)
+    return;
+
+  ++rx_stats_.packets;
+  rx_batch_.emplace_back(std::move(rx_partial_), rx_partial_info_);
+}
+
 void ebbrt::VirtioNetRep::ReceivePoll() {
-#ifndef VIRTIO_NET_POLL
 process:
-#endif
-  rcv_queue_.ProcessUsedBuffers([this](std::unique_ptr<MutIOBuf> buf) {
-    circ_buffer_[circ_buffer_head_ % 256] = std::move(buf);
-    ++circ_buffer_head_;
-    if (circ_buffer_head_ != circ_buffer_tail_ &&
-        (circ_buffer_head_ % 256) == (circ_buffer_tail_ % 256))
-      ++circ_buffer_tail_;
-  });
-  // If there are no used buffers, turn on interrupts and stop this poll
-  if (circ_buffer_head_ == circ_buffer_tail_) {
-#ifdef VIRTIO_NET_POLL
+  auto used = rcv_queue_->ProcessUsedBuffers(
+      [this](std::unique_ptr<MutIOBuf> buf) { ReceiveBuffer(std::move(buf)); },
+      kRxBudget);
+
+  if (used > 0) {
+    // Refill once for the whole batch, before the packets are processed so
+    // the device has buffers to receive into meanwhile
+    if (rcv_queue_->num_free_descriptors() * 4 >= rcv_queue_->Size()) {
+      FillRxRing();
+    }
+
+    if (likely(steer_batches_.empty())) {
+      for (auto& p : rx_batch_) {
+        gro_.Receive(std::move(p.first), p.second);
+      }
+    } else {
+      SteerBatch();
+    }
+    rx_batch_.clear();
+    // Segments are only merged within this batch, so none are held back
+    // waiting for a later poll. Handlers run in Flush(), by when rx_batch_ is
+    // free for a nested poll, whose packets gro_ delivers after ours.
+    gro_.Flush();
+  }
+
+  if (used == kRxBudget)
+    ++rx_stats_.budget_exhausted;
+
+  // Receive queue pair i is polled by core i
+  auto& config = VirtioNetDriver::PollConfigOf(Cpu::GetMine());
+  switch (config.mode) {
+  case VirtioNetDriver::PollConfig::kInterrupt:
+    // There may be more to process, let other events run and poll again
+    if (used == kRxBudget)
+      return;
+    break;
+  case VirtioNetDriver::PollConfig::kPoll:
     return;
-#else
-    rcv_queue_.EnableInterrupts();
-    // Double check to avoid race
-    if (likely(!rcv_queue_.HasUsedBuffer())) {
-      receive_callback_.Stop();
+  case VirtioNetDriver::PollConfig::kAdaptive: {
+    if (used > 0 && (rx_polling_ || used >= config.busy_packets)) {
+      if (!rx_polling_) {
+        rx_polling_ = true;
+        ++rx_stats_.to_poll;
+      }
+      rx_last_busy_ = clock::Wall::Now();
       return;
-    } else {
-      // raced, disable interrupts
-      rcv_queue_.DisableInterrupts();
-      goto process;
     }
-#endif
+    if (rx_polling_) {
+      if (clock::Wall::Now() - rx_last_busy_ < config.idle_timeout)
+        return;
+      rx_polling_ = false;
+      ++rx_stats_.to_interrupt;
+    } else if (used == kRxBudget) {
+      return;
+    }
+    break;
+  }
   }
 
-  kassert(circ_buffer_head_ != circ_buffer_tail_);
-  kassert(circ_buffer_[circ_buffer_tail_ % 256]);
-  auto b = std::move(circ_buffer_[circ_buffer_tail_ % 256]);
-  ++circ_buffer_tail_;
+  // No more used buffers, turn on interrupts and stop this poll
+  rcv_queue_->EnableInterrupts();
+  // Double check to avoid race
+  if (likely(!rcv_queue_->HasUsedBuffer())) {
+    receive_callback_.Stop();
+    return;
+  }
+  // raced, disable interrupts
+  rcv_queue_->DisableInterrupts();
+  goto process;
+}
 
-  if (rcv_queue_.num_free_descriptors() * 2 >= rcv_queue_.Size()) {
-    FillRxRing();
+// Hand each packet of the batch to the core its flow is steered to. Every
+// core gets its packets in one event, where they go through receive offload
+// as if that core had received them itself. Our own are left in gro_ for the
+// caller to flush.
+void ebbrt::VirtioNetRep::SteerBatch() {
+  size_t mine = Cpu::GetMine();
+  auto ncpus = steer_batches_.size();
+  for (auto& p : rx_batch_) {
+    auto cpu = SteerCpu(*p.first, mine, ncpus);
+    if (cpu == mine) {
+      gro_.Receive(std::move(p.first), p.second);
+    } else {
+      ++rx_stats_.steered;
+      steer_batches_[cpu].emplace_back(std::move(p));
+    }
   }
 
-  kassert(b->CountChainElements() == 1);
-  // auto header = reinterpret_cast<VirtioNetHeader*>(b->MutData());
-  // if (header->flags & VirtioNetHeader::kNeedsCsum) {
+  for (size_t cpu = 0; cpu < ncpus; ++cpu) {
+    auto& steered = steer_batches_[cpu];
+    if (steered.empty())
+      continue;
+
+    auto f = [ ebb = root_.ebb_, steered = std::move(steered) ]() mutable {
+      ebb->ReceiveSteered(std::move(steered));
+    };
+    event_manager->SpawnRemote(std::move(f), cpu);
+    steered.clear();
+  }
+}
 
-  // }
-  b->Advance(sizeof(VirtioNetHeader));
-  root_.itf_.Receive(std::move(b));
+// Steered packets share gro_ with those of our own queue, so if a handler
+// blocks, the packets of a later batch or poll are delivered after the rest
+// of this one
+void ebbrt::VirtioNetRep::ReceiveSteered(std::vector<RxPacket> batch) {
+  for (auto& p : batch) {
+    gro_.Receive(std::move(p.first), p.second);
+  }
+  gro_.Flush();
 }
 
 void ebbrt::VirtioNetRep::FillRxRing() {
-  auto num_bufs = rcv_queue_.num_free_descriptors();
+  auto num_bufs = rcv_queue_->num_free_descriptors();
   auto bufs = std::vector<std::unique_ptr<MutIOBuf>>();
   bufs.reserve(num_bufs);
 
   for (size_t i = 0; i < num_bufs; ++i) {
-    bufs.emplace_back(MakeUniqueIOBuf(65562));
+    bufs.emplace_back(MakePooledIOBuf(kRxBufferSize));
   }
 
-  auto it = rcv_queue_.AddWritableBuffers(bufs.begin(), bufs.end());
+  auto it = rcv_queue_->AddWritableBuffers(bufs.begin(), bufs.end());
   kassert(it == bufs.end());
 }
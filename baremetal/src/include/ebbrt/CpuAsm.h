@@ -11,6 +11,29 @@ inline uintptr_t ReadCr3() {
   asm volatile("mov %%cr3, %[cr3]" : [cr3] "=r"(cr3));
   return cr3;
 }
+
+inline uintptr_t ReadCr4() {
+  uintptr_t cr4;
+  asm volatile("mov %%cr4, %[cr4]" : [cr4] "=r"(cr4));
+  return cr4;
+}
+
+inline void WriteCr4(uintptr_t cr4) {
+  asm volatile("mov %[cr4], %%cr4" : : [cr4] "r"(cr4));
+}
+
+inline uint64_t ReadXcr(uint32_t reg) {
+  uint32_t low, high;
+  asm volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(reg));
+  return static_cast<uint64_t>(high) << 32 | low;
+}
+
+inline void WriteXcr(uint32_t reg, uint64_t val) {
+  asm volatile("xsetbv"
+               :
+               : "c"(reg), "a"(static_cast<uint32_t>(val)),
+                 "d"(static_cast<uint32_t>(val >> 32)));
+}
 }
 
 #endif  // BAREMETAL_SRC_INCLUDE_EBBRT_CPUASM_H_
@@ -20,11 +20,14 @@ struct Features {
   bool x2apic;
   bool kvm_pv_eoi;
   bool kvm_clocksource2;
+  bool xsave;
+  bool avx;
+  bool avx2;
 };
 
 extern Features features;
 
-Result Cpuid(uint32_t leaf);
+Result Cpuid(uint32_t leaf, uint32_t subleaf = 0);
 void Init();
 }  // namespace cpuid
 }  // namespace ebbrt
@@ -0,0 +1,117 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef BAREMETAL_SRC_INCLUDE_EBBRT_EVENTARENA_H_
+#define BAREMETAL_SRC_INCLUDE_EBBRT_EVENTARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/utility.hpp>
+
+#include <ebbrt/Align.h>
+#include <ebbrt/Compiler.h>
+
+namespace ebbrt {
+// Bump allocator for short lived allocations. Nothing is freed individually,
+// all memory is given back at once when the arena is released. Each event
+// owns an arena (see GetEventArena()) which is released when the event
+// completes, and follows the event across blocking points.
+class EventArena : boost::noncopyable {
+ public:
+  static const constexpr size_t kChunkSize = 16 * 1024;
+
+  // A position in the arena that can be rewound to
+  class Mark {
+    Mark(void* chunk, uintptr_t cur) : chunk_(chunk), cur_(cur) {}
+
+    void* chunk_;
+    uintptr_t cur_;
+
+    friend class EventArena;
+  };
+
+  // Releases everything allocated in the arena during its lifetime
+  class Scope : boost::noncopyable {
+   public:
+    explicit Scope(EventArena& arena) : arena_(arena), mark_(arena.GetMark()) {}
+    ~Scope() { arena_.Rewind(mark_); }
+
+   private:
+    EventArena& arena_;
+    Mark mark_;
+  };
+
+  EventArena() = default;
+  ~EventArena() { Release(); }
+
+  void* Alloc(size_t size, size_t align = alignof(max_align_t)) {
+    auto ret = align::Up(cur_, align);
+    if (likely(ret + size <= end_ && ret + size >= ret)) {
+      cur_ = ret + size;
+      return reinterpret_cast<void*>(ret);
+    }
+    return AllocSlow(size, align);
+  }
+
+  Mark GetMark() const { return Mark(head_, cur_); }
+  void Rewind(const Mark& mark);
+  void Release();
+
+ private:
+  struct Chunk {
+    Chunk* next;
+    uintptr_t end;
+  };
+
+  void* AllocSlow(size_t size, size_t align);
+
+  Chunk* head_ = nullptr;
+  uintptr_t cur_ = 0;
+  uintptr_t end_ = 0;
+};
+
+// Arena of the active event
+EventArena& GetEventArena();
+
+// STL allocator which allocates out of an EventArena. The allocator must not
+// outlive the arena it allocates from.
+template <typename T> class EventArenaAllocator {
+ public:
+  typedef T value_type;
+
+  EventArenaAllocator() : arena_(&GetEventArena()) {}
+  explicit EventArenaAllocator(EventArena& arena) noexcept : arena_(&arena) {}
+  template <typename U>
+  EventArenaAllocator(const EventArenaAllocator<U>& other) noexcept
+      : arena_(other.arena_) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena_->Alloc(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T* p, size_t n) noexcept {}
+
+ private:
+  EventArena* arena_;
+
+  template <typename U> friend class EventArenaAllocator;
+  template <typename U, typename V>
+  friend bool operator==(const EventArenaAllocator<U>&,
+                         const EventArenaAllocator<V>&) noexcept;
+};
+
+template <typename T, typename U>
+bool operator==(const EventArenaAllocator<T>& lhs,
+                const EventArenaAllocator<U>& rhs) noexcept {
+  return lhs.arena_ == rhs.arena_;
+}
+
+template <typename T, typename U>
+bool operator!=(const EventArenaAllocator<T>& lhs,
+                const EventArenaAllocator<U>& rhs) noexcept {
+  return !(lhs == rhs);
+}
+}  // namespace ebbrt
+
+#endif  // BAREMETAL_SRC_INCLUDE_EBBRT_EVENTARENA_H_
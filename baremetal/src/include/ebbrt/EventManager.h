@@ -15,9 +15,11 @@
 #include <boost/utility.hpp>
 
 #include <ebbrt/Cpu.h>
+#include <ebbrt/EventArena.h>
 #include <ebbrt/Isr.h>
 #include <ebbrt/Main.h>
 #include <ebbrt/MoveLambda.h>
+#include <ebbrt/SlabStlAllocator.h>
 #include <ebbrt/Smp.h>
 #include <ebbrt/Timer.h>
 #include <ebbrt/Trans.h>
@@ -27,8 +29,18 @@ namespace ebbrt {
 
 class EventManager : Timer::Hook {
   typedef boost::container::flat_map<size_t, ebbrt::EventManager*> RepMap;
+  typedef std::list<MovableFunction<void()>,
+                    SlabStlAllocator<MovableFunction<void()>>>
+      TaskList;
+  typedef std::queue<MovableFunction<void()>, TaskList> RcuTaskQueue;
 
  public:
+  typedef std::unordered_map<
+      __gthread_key_t, void*, std::hash<__gthread_key_t>,
+      std::equal_to<__gthread_key_t>,
+      SlabStlAllocator<std::pair<const __gthread_key_t, void*>>>
+      TlsMap;
+
   struct EventContext {
     EventContext();
     EventContext(uint32_t event_id, Pfn stack);
@@ -45,7 +57,8 @@ class EventManager : Timer::Hook {
     uint64_t r15;
     uint32_t event_id;
     Pfn stack;
-    std::unique_ptr<std::unordered_map<__gthread_key_t, void*>> tls;
+    std::unique_ptr<TlsMap> tls;
+    std::unique_ptr<EventArena> arena;
     size_t cpu;
     size_t generation;
   };
@@ -76,7 +89,8 @@ class EventManager : Timer::Hook {
   void ActivateContextSync(EventContext&& context);
   uint8_t AllocateVector(MovableFunction<void()> func);
   uint32_t GetEventId();
-  std::unordered_map<__gthread_key_t, void*>& GetTlsMap();
+  TlsMap& GetTlsMap();
+  EventArena& GetArena();
   void DoRcu(MovableFunction<void()> func);
   void Fire() override;
 
@@ -101,7 +115,7 @@ class EventManager : Timer::Hook {
 
   const RepMap& reps_;
   std::stack<Pfn> free_stacks_;
-  std::list<MovableFunction<void()>> tasks_;
+  TaskList tasks_;
   uint32_t next_event_id_;
   EventContext active_event_context_;
   std::stack<EventContext> sync_contexts_;
@@ -110,12 +124,12 @@ class EventManager : Timer::Hook {
   size_t generation_ = 0;
   std::array<size_t, 2> generation_count_ = {{0}};
   size_t pending_generation_ = 0;
-  std::queue<MovableFunction<void()>> prev_rcu_tasks_;
-  std::queue<MovableFunction<void()>> curr_rcu_tasks_;
+  RcuTaskQueue prev_rcu_tasks_;
+  RcuTaskQueue curr_rcu_tasks_;
 
   struct RemoteData : CacheAligned {
     ebbrt::SpinLock lock;
-    std::list<MovableFunction<void()>> tasks;
+    TaskList tasks;
   } remote_;
 
   friend void ebbrt::idt::EventInterrupt(int num);
@@ -7,11 +7,16 @@
 
 #include <array>
 
+#include <boost/container/static_vector.hpp>
+
+#include <ebbrt/Align.h>
 #include <ebbrt/CacheAligned.h>
 #include <ebbrt/CpuAsm.h>
 #include <ebbrt/Debug.h>
+#include <ebbrt/Fls.h>
 #include <ebbrt/SlabAllocator.h>
 #include <ebbrt/Trans.h>
+#include <ebbrt/VMem.h>
 #include <ebbrt/VMemAllocator.h>
 
 namespace ebbrt {
@@ -56,103 +61,39 @@ class GeneralPurposeAllocator : public CacheAligned {
   void operator delete(void* p) { EBBRT_UNIMPLEMENTED(); }
 
   void* Alloc(size_t size) {
-    Indexer<0, sizes_in...> i;
-    auto index = i(size);
+    auto index = SizeClass(size);
     if (likely(index != -1)) {
-      auto ret = allocators_[index]->Alloc();
-      kbugon(ret == nullptr,
-             "Failed to allocate from this NUMA node, should try others\n");
-      return ret;
+      // the slab allocator falls back to other nodes, so this only fails once
+      // every node is out of memory
+      return allocators_[index]->Alloc();
     }
-    const constexpr size_t large_page_size = 2 * 1024 * 1024;
-    const constexpr size_t large_page_order = 9;
-    auto sz = align::Up(size, large_page_size);
-    auto npages = sz / pmem::kPageSize;
-    auto pages_per_large_page = large_page_size / pmem::kPageSize;
-    // Need to allocate a virtual region
-    auto vfn = vmem_allocator->Alloc(npages, pages_per_large_page);
-    kbugon(vfn == Pfn::None(), "Failed to allocated virtual region\n");
-    auto pte_root = vmem::Pte(ReadCr3());
-    auto vaddr = vfn.ToAddr();
-    vmem::TraversePageTable(
-        pte_root, vaddr, vaddr + sz, 0, 4,
-        [](vmem::Pte& entry, uint64_t base_virt, size_t level) {
-          kassert(!entry.Present() && level == 1);
-          auto pfn = page_allocator->Alloc(large_page_order);
-          kbugon(pfn == Pfn::None(),
-                 "Failed to allocate page in gp allocator\n");
-          entry.SetLarge(pfn.ToAddr());
-          std::atomic_thread_fence(std::memory_order_release);
-        },
-        [](vmem::Pte& entry) {
-          auto page = page_allocator->Alloc();
-          kbugon(page == Pfn::None(),
-                 "Failed to allocate page in gp allocator\n");
-          auto page_addr = page.ToAddr();
-          new (reinterpret_cast<void*>(page_addr)) vmem::Pte[512];
-          entry.SetNormal(page_addr);
-          return true;
-        });
-    return reinterpret_cast<void*>(vaddr);
+    return AllocLarge(size, vmem::kLargePageSize);
   }
 
   void* Alloc(size_t size, size_t alignment) {
-    Indexer<0, sizes_in...> i;
-    auto index = i(size);
+    auto index = SizeClass(size);
+    // Objects are laid out back to back from the (aligned) start of a slab, so
+    // only classes that are a multiple of the alignment keep it
+    while (index != -1 && kClassSizes[index] % alignment != 0) {
+      index = static_cast<size_t>(index + 1) < kNumClasses ? index + 1 : -1;
+    }
     if (likely(index != -1)) {
-      auto ret = allocators_[index]->Alloc();
-      kbugon(ret == nullptr,
-             "Failed to allocate from this NUMA node, should try others\n");
-      return ret;
+      return allocators_[index]->Alloc();
     }
-    const constexpr size_t large_page_size = 2 * 1024 * 1024;
-    const constexpr size_t large_page_order = 9;
-    auto sz = align::Up(size, large_page_size);
-    auto npages = sz / pmem::kPageSize;
-    auto align = align::Up(alignment, large_page_size);
-    auto align_pages = align / pmem::kPageSize;
-    // Need to allocate a virtual region
-    auto vfn = vmem_allocator->Alloc(npages, align_pages);
-    kbugon(vfn == Pfn::None(), "Failed to allocated virtual region\n");
-    auto pte_root = vmem::Pte(ReadCr3());
-    auto vaddr = vfn.ToAddr();
-    vmem::TraversePageTable(
-        pte_root, vaddr, vaddr + sz, 0, 4,
-        [](vmem::Pte& entry, uint64_t base_virt, size_t level) {
-          kassert(!entry.Present() && level == 1);
-          auto pfn = page_allocator->Alloc(large_page_order);
-          kbugon(pfn == Pfn::None(),
-                 "Failed to allocate page in gp allocator\n");
-          entry.SetLarge(pfn.ToAddr());
-          std::atomic_thread_fence(std::memory_order_release);
-        },
-        [](vmem::Pte& entry) {
-          auto page = page_allocator->Alloc();
-          kbugon(page == Pfn::None(),
-                 "Failed to allocate page in gp allocator\n");
-          auto page_addr = page.ToAddr();
-          new (reinterpret_cast<void*>(page_addr)) vmem::Pte[512];
-          entry.SetNormal(page_addr);
-          return true;
-        });
-    return reinterpret_cast<void*>(vaddr);
+    return AllocLarge(size, align::Up(alignment, vmem::kLargePageSize));
   }
 
   void* AllocNid(size_t size, Nid nid = Cpu::GetMyNode()) {
-    Indexer<0, sizes_in...> i;
-    auto index = i(size);
+    auto index = SizeClass(size);
     kbugon(index == -1, "Attempt to allocate %u bytes not supported\n", size);
-    auto ret = allocators_[index]->AllocNid(nid);
-    kbugon(ret == nullptr,
-           "Failed to allocate from this NUMA node, should try others\n");
-    return ret;
+    return allocators_[index]->AllocNid(nid);
   }
 
   void Free(void* p) {
     if (p == nullptr)
       return;
     if (reinterpret_cast<uintptr_t>(p) > 0xFFFF800000000000) {
-      kprintf("UNIMPLEMENTED: Free Large memory region\n");
+      FreeLarge(p);
       return;
     }
     auto page = mem_map::AddrToPage(p);
@@ -163,6 +104,52 @@ class GeneralPurposeAllocator : public CacheAligned {
   }
 
  private:
+  // Freed large regions are kept mapped on the freeing core so that repeated
+  // large alloc/free cycles do not go back to the page tables each time
+  static const constexpr size_t kLargeCacheEntries = 4;
+  static const constexpr size_t kLargeCacheMaxPages =
+      (64 * 1024 * 1024) / pmem::kPageSize;
+
+  struct LargeRegion {
+    Pfn vfn;
+    size_t npages;
+  };
+
+  void* AllocLarge(size_t size, size_t alignment) {
+    auto npages = align::Up(size, vmem::kLargePageSize) / pmem::kPageSize;
+    // Reuse a cached region if it is aligned and would not waste more than
+    // the request itself
+    for (auto it = large_cache_.begin(); it != large_cache_.end(); ++it) {
+      if (it->npages >= npages && it->npages <= 2 * npages &&
+          align::Down(it->vfn.ToAddr(), alignment) == it->vfn.ToAddr()) {
+        auto vaddr = it->vfn.ToAddr();
+        large_cache_.erase(it);
+        return reinterpret_cast<void*>(vaddr);
+      }
+    }
+    // Need to allocate a virtual region
+    auto vfn = vmem_allocator->Alloc(npages, alignment / pmem::kPageSize);
+    kbugon(vfn == Pfn::None(), "Failed to allocated virtual region\n");
+    vmem::MapLargePages(vfn, npages);
+    return reinterpret_cast<void*>(vfn.ToAddr());
+  }
+
+  void FreeLarge(void* p) {
+    auto vfn = Pfn::Down(reinterpret_cast<uintptr_t>(p));
+    auto npages = vmem_allocator->RegionPages(vfn);
+    if (npages > kLargeCacheMaxPages) {
+      vmem::UnmapLargePages(vfn, npages);
+      return;
+    }
+    if (large_cache_.size() == kLargeCacheEntries) {
+      // evict the oldest entry
+      auto& oldest = large_cache_.front();
+      vmem::UnmapLargePages(oldest.vfn, oldest.npages);
+      large_cache_.erase(large_cache_.begin());
+    }
+    large_cache_.emplace_back(LargeRegion{vfn, npages});
+  }
+
   template <size_t index, size_t... tail> struct Construct {
     void
     operator()(std::array<SlabAllocatorRoot*, sizeof...(sizes_in)>& roots) {}
@@ -182,26 +169,60 @@ class GeneralPurposeAllocator : public CacheAligned {
     }
   };
 
-  template <size_t index, size_t... tail> struct Indexer {
-    ssize_t operator()(size_t size) { return -1; }
-  };
+  // Size classes are looked up through a table indexed by the most
+  // significant bit of (size - 1) and the two bits below it. Each power of two
+  // range is split into quarters, so the table maps each bucket to the
+  // smallest class that holds every size in it.
+  static const constexpr size_t kNumClasses = sizeof...(sizes_in);
+  static const constexpr size_t kClassSizes[kNumClasses] = {sizes_in...};
+  static const constexpr size_t kMaxClassSize = kClassSizes[kNumClasses - 1];
 
-  template <size_t index, size_t head, size_t... tail>
-  struct Indexer<index, head, tail...> {
-    ssize_t operator()(size_t size) {
-      if (size <= head) {
-        return index;
-      } else {
-        Indexer<index + 1, tail...> i;
-        return i(size);
+  static constexpr size_t SizeBucket(size_t size) {
+    size_t n = size == 0 ? 0 : size - 1;
+    if (n < 4)
+      return n;
+    auto msb = Fls(n);
+    return 4 * (msb - 1) + ((n >> (msb - 2)) & 3);
+  }
+
+  // The largest size that falls in the bucket
+  static constexpr size_t BucketLimit(size_t bucket) {
+    if (bucket < 4)
+      return bucket + 1;
+    return (5 + bucket % 4) << (bucket / 4 - 1);
+  }
+
+  static const constexpr size_t kNumBuckets = SizeBucket(kMaxClassSize) + 1;
+
+  struct ClassTable {
+    constexpr ClassTable() : index() {
+      size_t c = 0;
+      for (size_t b = 0; b < kNumBuckets; ++b) {
+        while (c < kNumClasses && kClassSizes[c] < BucketLimit(b))
+          ++c;
+        index[b] = c < kNumClasses ? c : -1;
       }
     }
+
+    int8_t index[kNumBuckets];
   };
 
+  static_assert(kNumClasses < INT8_MAX, "too many gp allocator size classes");
+
+  static const constexpr ClassTable kClassTable{};
+
+  static ssize_t SizeClass(size_t size) {
+    if (unlikely(size > kMaxClassSize))
+      return -1;
+    return kClassTable.index[SizeBucket(size)];
+  }
+
   static std::array<SlabAllocatorRoot*, sizeof...(sizes_in)> allocator_roots;
   static std::array<GeneralPurposeAllocator<sizes_in...>*, Cpu::kMaxCpus> reps;
   static SlabAllocatorRoot* rep_allocator;
   std::array<SlabAllocator*, sizeof...(sizes_in)> allocators_;
+  boost::container::static_vector<LargeRegion, kLargeCacheEntries>
+      large_cache_;
 };
 
 template <size_t... sizes_in>
@@ -215,11 +236,27 @@ std::array<GeneralPurposeAllocator<sizes_in...>*, Cpu::kMaxCpus>
 template <size_t... sizes_in>
 SlabAllocatorRoot* GeneralPurposeAllocator<sizes_in...>::rep_allocator;
 
-// roughly equivalent to the breakdown Linux uses, may need tuning
+template <size_t... sizes_in>
+const constexpr size_t GeneralPurposeAllocator<
+    sizes_in...>::kClassSizes[GeneralPurposeAllocator<sizes_in...>::kNumClasses];
+
+template <size_t... sizes_in>
+const constexpr typename GeneralPurposeAllocator<sizes_in...>::ClassTable
+    GeneralPurposeAllocator<sizes_in...>::kClassTable;
+
+// Quarter power of two steps from 64 bytes up to 2MB, every class is a
+// multiple of 16 bytes to preserve malloc alignment. Above 2MB a slab holds
+// at most a couple of objects so the finer classes would not save memory.
 typedef GeneralPurposeAllocator<
-    8, 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2 * 1024, 4 * 1024, 8 * 1024,
-    16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024,
-    1024 * 1024, 2 * 1024 * 1024, 4 * 1024 * 1024, 8 * 1024 * 1024>
+    8, 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448,
+    512, 640, 768, 896, 1024, 1280, 1536, 1792, 2 * 1024, 2560, 3 * 1024, 3584,
+    4 * 1024, 5 * 1024, 6 * 1024, 7 * 1024, 8 * 1024, 10 * 1024, 12 * 1024,
+    14 * 1024, 16 * 1024, 20 * 1024, 24 * 1024, 28 * 1024, 32 * 1024,
+    40 * 1024, 48 * 1024, 56 * 1024, 64 * 1024, 80 * 1024, 96 * 1024,
+    112 * 1024, 128 * 1024, 160 * 1024, 192 * 1024, 224 * 1024, 256 * 1024,
+    320 * 1024, 384 * 1024, 448 * 1024, 512 * 1024, 640 * 1024, 768 * 1024,
+    896 * 1024, 1024 * 1024, 1280 * 1024, 1536 * 1024, 1792 * 1024,
+    2 * 1024 * 1024, 4 * 1024 * 1024, 8 * 1024 * 1024>
     GeneralPurposeAllocatorType;
 
 constexpr auto gp_allocator =
@@ -0,0 +1,164 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef BAREMETAL_SRC_INCLUDE_EBBRT_LOCALSHAREDIOBUFREF_H_
+#define BAREMETAL_SRC_INCLUDE_EBBRT_LOCALSHAREDIOBUFREF_H_
+
+#include <atomic>
+#include <cstdlib>
+
+#include <ebbrt/IOBuf.h>
+
+namespace ebbrt {
+class LocalSharedIOBufRefOwner;
+
+typedef IOBufBase<LocalSharedIOBufRefOwner> LocalSharedIOBufRef;
+typedef MutIOBufBase<LocalSharedIOBufRefOwner> MutLocalSharedIOBufRef;
+
+// Like SharedIOBufRef, but the reference count is biased towards the core
+// that created it. References taken and dropped on that core use a plain
+// counter. References on other cores use an atomic counter, and the first
+// time that goes negative the owner is asked to merge its plain count into
+// it. From then on every core uses the atomic counter.
+class LocalSharedIOBufRefOwner {
+ public:
+  struct CloneView_s {};
+  static const constexpr CloneView_s CloneView = {};
+  explicit LocalSharedIOBufRefOwner(std::unique_ptr<IOBuf>&& buf);
+  LocalSharedIOBufRefOwner(const LocalSharedIOBufRefOwner& other);
+  LocalSharedIOBufRefOwner& operator=(const LocalSharedIOBufRefOwner&) = delete;
+  ~LocalSharedIOBufRefOwner();
+
+  const uint8_t* Buffer() const;
+  size_t Capacity() const;
+
+ protected:
+  const IOBuf& GetRef() { return *control_->buf; }
+
+ private:
+  struct Control {
+    // The shared count is kept shifted so the flags fit in the low bits
+    static const constexpr int64_t kMerged = 1;
+    static const constexpr int64_t kQueued = 2;
+    static const constexpr int64_t kOne = 4;
+
+    Control(std::unique_ptr<IOBuf>&& b, size_t cpu);
+    void Acquire();
+    void Release();
+    void ReleaseShared();
+    void Merge();
+
+    std::unique_ptr<IOBuf> buf;
+    size_t owner;
+    // only accessed on the owner
+    size_t biased{1};
+    bool merged{false};
+    std::atomic<int64_t> shared{0};
+  };
+
+  Control* control_;
+};
+
+template <>
+class IOBufBase<LocalSharedIOBufRefOwner> : public LocalSharedIOBufRefOwner,
+                                            public IOBuf {
+ public:
+  template <typename... Args>
+  explicit IOBufBase(Args&&... args)
+      : LocalSharedIOBufRefOwner(std::forward<Args>(args)...),
+        IOBuf(LocalSharedIOBufRefOwner::Buffer(),
+              LocalSharedIOBufRefOwner::Capacity()) {}
+
+  template <typename... Args>
+  explicit IOBufBase(LocalSharedIOBufRefOwner::CloneView_s, Args&&... args)
+      : LocalSharedIOBufRefOwner(std::forward<Args>(args)...),
+        IOBuf(LocalSharedIOBufRefOwner::Buffer(),
+              LocalSharedIOBufRefOwner::Capacity()) {
+    IOBuf::SetView(LocalSharedIOBufRefOwner::GetRef());
+  }
+
+  IOBufBase(LocalSharedIOBufRefOwner::CloneView_s,
+            const LocalSharedIOBufRef& r)
+      : LocalSharedIOBufRefOwner(r),
+        IOBuf(LocalSharedIOBufRefOwner::Buffer(),
+              LocalSharedIOBufRefOwner::Capacity()) {
+    IOBuf::SetView(r);
+  }
+
+  IOBufBase(LocalSharedIOBufRefOwner::CloneView_s, LocalSharedIOBufRef& r)
+      : LocalSharedIOBufRefOwner(r),
+        IOBuf(LocalSharedIOBufRefOwner::Buffer(),
+              LocalSharedIOBufRefOwner::Capacity()) {
+    IOBuf::SetView(r);
+  }
+
+  const uint8_t* Buffer() const override {
+    return LocalSharedIOBufRefOwner::Buffer();
+  }
+
+  size_t Capacity() const override {
+    return LocalSharedIOBufRefOwner::Capacity();
+  }
+};
+
+template <>
+class MutIOBufBase<LocalSharedIOBufRefOwner> : public LocalSharedIOBufRefOwner,
+                                               public MutIOBuf {
+ public:
+  template <typename... Args>
+  explicit MutIOBufBase(Args&&... args)
+      : LocalSharedIOBufRefOwner(std::forward<Args>(args)...),
+        MutIOBuf(LocalSharedIOBufRefOwner::Buffer(),
+                 LocalSharedIOBufRefOwner::Capacity()) {}
+
+  template <typename... Args>
+  explicit MutIOBufBase(LocalSharedIOBufRefOwner::CloneView_s, Args&&... args)
+      : LocalSharedIOBufRefOwner(std::forward<Args>(args)...),
+        MutIOBuf(LocalSharedIOBufRefOwner::Buffer(),
+                 LocalSharedIOBufRefOwner::Capacity()) {
+    MutIOBuf::SetView(LocalSharedIOBufRefOwner::GetRef());
+  }
+
+  MutIOBufBase(LocalSharedIOBufRefOwner::CloneView_s,
+               const MutLocalSharedIOBufRef& r)
+      : LocalSharedIOBufRefOwner(r),
+        MutIOBuf(LocalSharedIOBufRefOwner::Buffer(),
+                 LocalSharedIOBufRefOwner::Capacity()) {
+    MutIOBuf::SetView(r);
+  }
+
+  MutIOBufBase(LocalSharedIOBufRefOwner::CloneView_s,
+               MutLocalSharedIOBufRef& r)
+      : LocalSharedIOBufRefOwner(r),
+        MutIOBuf(LocalSharedIOBufRefOwner::Buffer(),
+                 LocalSharedIOBufRefOwner::Capacity()) {
+    MutIOBuf::SetView(r);
+  }
+
+  const uint8_t* Buffer() const override {
+    return LocalSharedIOBufRefOwner::Buffer();
+  }
+
+  size_t Capacity() const override {
+    return LocalSharedIOBufRefOwner::Capacity();
+  }
+};
+
+// Replaces each buffer of the chain with a MutLocalSharedIOBufRef which owns
+// it, so that references to any buffer can be cloned with
+// CloneLocalSharedRef()
+std::unique_ptr<MutIOBuf> MakeLocalSharedChain(std::unique_ptr<IOBuf> buf);
+
+// Clones a buffer of a chain created by MakeLocalSharedChain(), or any other
+// MutLocalSharedIOBufRef, which debug builds check. The clone keeps the data
+// alive regardless of what happens to the original.
+std::unique_ptr<MutIOBuf> CloneLocalSharedRef(const IOBuf& buf);
+
+// Splits the first len bytes of the first buffer of buf into a buffer of its
+// own, which is returned. Both share ownership of the data.
+std::unique_ptr<MutIOBuf> SplitLocalSharedRef(std::unique_ptr<IOBuf>& buf,
+                                              size_t len);
+}  // namespace ebbrt
+
+#endif  // BAREMETAL_SRC_INCLUDE_EBBRT_LOCALSHAREDIOBUFREF_H_
@@ -0,0 +1,97 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef BAREMETAL_SRC_INCLUDE_EBBRT_LOOPBACKNET_H_
+#define BAREMETAL_SRC_INCLUDE_EBBRT_LOOPBACKNET_H_
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include <ebbrt/CacheAligned.h>
+#include <ebbrt/Clock.h>
+#include <ebbrt/Net.h>
+#include <ebbrt/Timer.h>
+
+namespace ebbrt {
+// An in-memory ethernet device: every frame sent is received back on the same
+// interface, so the network stack can be exercised and measured on one node
+// without a nic. Frames are copied on send as a real device would, and are
+// delivered on the sending core once their latency has passed. Loss and
+// reordering only apply to ip packets, the stack does not retry arp.
+class LoopbackNetDevice : public EthernetDevice, boost::noncopyable {
+ public:
+  struct Config {
+    // one way delay of every packet
+    std::chrono::microseconds latency{0};
+    // fraction of ip packets dropped
+    double loss{0};
+    // fraction of ip packets held back by reorder_delay, so that the packets
+    // sent after them overtake them
+    double reorder{0};
+    std::chrono::microseconds reorder_delay{100};
+    // Like a nic with checksum offload, packets the stack asks to be
+    // checksummed are delivered as validated. Otherwise the device computes
+    // the checksum while copying and the receiver verifies it.
+    bool csum_offload{true};
+  };
+
+  struct Stats {
+    uint64_t packets{0};
+    uint64_t bytes{0};
+    // tso and ufo packets, delivered without being segmented
+    uint64_t gso_packets{0};
+    // checksums computed by the device
+    uint64_t csums{0};
+    uint64_t dropped{0};
+    uint64_t reordered{0};
+  };
+
+  // Creates the interface, with address on a /8 network
+  explicit LoopbackNetDevice(Ipv4Address address);
+  LoopbackNetDevice(Ipv4Address address, const Config& config);
+  void Send(std::unique_ptr<MutIOBuf> buf, PacketInfo pinfo) override;
+  const EthernetAddress& GetMacAddress() override;
+  // Not synchronized with Send, change it while no traffic is in flight
+  void SetConfig(const Config& config) { config_ = config; }
+  const Config& GetConfig() const { return config_; }
+  // Sum of the counters of all cores
+  Stats GetStats() const;
+
+ private:
+  typedef std::pair<std::unique_ptr<MutIOBuf>, RxInfo> RxPacket;
+
+  // Packets sent on a core are delivered on that core
+  struct alignas(cache_size) CoreQueue : CacheAligned, Timer::Hook {
+    explicit CoreQueue(LoopbackNetDevice& dev);
+    void Fire() override;
+    void ScheduleDelivery();
+    void Deliver();
+    void ArmTimer();
+    bool Chance(double p);
+
+    LoopbackNetDevice& dev;
+    // packets due now, in order from next_ready on
+    std::vector<RxPacket> ready;
+    size_t next_ready{0};
+    bool delivery_pending{false};
+    // packets waiting for their delivery time
+    std::multimap<clock::Wall::time_point, RxPacket> delayed;
+    bool timer_set{false};
+    clock::Wall::time_point timer_due;
+    uint64_t rng;
+    Stats stats;
+  };
+
+  Config config_;
+  EthernetAddress mac_addr_;
+  NetworkManager::Interface& itf_;
+  std::vector<std::unique_ptr<CoreQueue>> queues_;
+};
+}  // namespace ebbrt
+
+#endif  // BAREMETAL_SRC_INCLUDE_EBBRT_LOOPBACKNET_H_
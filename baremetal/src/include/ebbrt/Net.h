@@ -22,12 +22,18 @@
 #include <ebbrt/NetTcp.h>
 #include <ebbrt/RcuTable.h>
 #include <ebbrt/SharedPoolAllocator.h>
+#include <ebbrt/SlabStlAllocator.h>
 #include <ebbrt/SpinLock.h>
 #include <ebbrt/StaticSharedEbb.h>
 
 namespace ebbrt {
 struct PacketInfo {
   static const constexpr uint8_t kNeedsCsum = 1;
+  // More packets follow right away, so the device may hold off notifying the
+  // hardware. The last packet of a batch must be sent without it, or the
+  // batch ended with EthernetDevice::SendFlush() in case that packet never
+  // reached the device.
+  static const constexpr uint8_t kMore = 2;
   static const constexpr uint8_t kGsoNone = 0;
   static const constexpr uint8_t kGsoTcpv4 = 1;
   static const constexpr uint8_t kGsoUdp = 3;
@@ -41,16 +47,43 @@ struct PacketInfo {
   uint16_t csum_offset{0};
 };
 
+// What a device knows about a received packet
+struct RxInfo {
+  // The transport checksum was verified (or the packet never crossed a wire)
+  // so the stack need not check it
+  static const constexpr uint8_t kCsumValid = 1;
+
+  uint8_t flags{0};
+};
+
 class EthernetDevice {
  public:
-  virtual void Send(std::unique_ptr<IOBuf> buf,
+  // Space in front of the ethernet header a device may need for its own
+  // header. Packets built by the stack reserve it so that the device can
+  // Prepend its header in place.
+  static const constexpr size_t kHeadroom = 16;
+
+  virtual void Send(std::unique_ptr<MutIOBuf> buf,
                     PacketInfo pinfo = PacketInfo()) = 0;
+  // Whether the device has fallen far enough behind the packets sent from this
+  // core that senders which can hold on to their packets, like tcp, should
+  // hold them rather than have them dropped once its backlog overflows. It
+  // stays set until the device has mostly caught up.
+  virtual bool SendCongested() { return false; }
+  // Notify the hardware of any packets sent from this core with kMore which
+  // it has not been told about
+  virtual void SendFlush() {}
   virtual const EthernetAddress& GetMacAddress() = 0;
   virtual ~EthernetDevice() {}
 };
 
 class NetworkManager : public StaticSharedEbb<NetworkManager> {
  public:
+  // Headroom to reserve in front of a transport header for the ip, ethernet
+  // and device headers
+  static const constexpr size_t kTxHeadroom =
+      sizeof(Ipv4Header) + sizeof(EthernetHeader) + EthernetDevice::kHeadroom;
+
   struct UdpEntry {
     RcuHListHook hook;
     uint16_t port{0};
@@ -90,6 +123,9 @@ class NetworkManager : public StaticSharedEbb<NetworkManager> {
     uint16_t tcp_len;
   };
 
+  typedef boost::container::list<TcpSegment, SlabStlAllocator<TcpSegment>>
+      TcpSegmentList;
+
   class TcpPcb;
 
   struct ListeningTcpEntry : public CacheAligned {
@@ -137,7 +173,7 @@ class NetworkManager : public StaticSharedEbb<NetworkManager> {
     void ClearAckedSegments(const TcpInfo& info);
     size_t SendWindowRemaining();
     void SetTimer(ebbrt::clock::Wall::time_point now);
-    void SendSegment(TcpSegment& segment);
+    void SendSegment(TcpSegment& segment, bool more = false);
     void SendEmptyAck();
     void Close();
     void SendFin();
@@ -150,8 +186,8 @@ class NetworkManager : public StaticSharedEbb<NetworkManager> {
     size_t cpu;
     Ipv4Address address;
     std::tuple<Ipv4Address, uint16_t, uint16_t> key;
-    boost::container::list<TcpSegment> unacked_segments;
-    boost::container::list<TcpSegment> pending_segments;
+    TcpSegmentList unacked_segments;
+    TcpSegmentList pending_segments;
     enum State {
       kClosed,
       kSynSent,
@@ -181,6 +217,8 @@ class NetworkManager : public StaticSharedEbb<NetworkManager> {
     std::atomic_bool accepted{false};
     bool window_notify;
     bool timer_set{false};
+    // output is held back while the device is congested
+    bool send_paused{false};
   };
 
   class TcpPcb {
@@ -229,8 +267,10 @@ class NetworkManager : public StaticSharedEbb<NetworkManager> {
     explicit Interface(EthernetDevice& ether_dev)
         : address_(nullptr), ether_dev_(ether_dev) {}
 
-    void Receive(std::unique_ptr<MutIOBuf> buf);
-    void Send(std::unique_ptr<IOBuf> buf, PacketInfo pinfo = PacketInfo());
+    void Receive(std::unique_ptr<MutIOBuf> buf, RxInfo rinfo = RxInfo());
+    void Send(std::unique_ptr<MutIOBuf> buf, PacketInfo pinfo = PacketInfo());
+    bool SendCongested() { return ether_dev_.SendCongested(); }
+    void SendFlush() { ether_dev_.SendFlush(); }
     void SendUdp(UdpPcb& pcb, Ipv4Address addr, uint16_t port,
                  std::unique_ptr<IOBuf> buf);
     void SendIp(std::unique_ptr<MutIOBuf> buf, Ipv4Address src, Ipv4Address dst,
@@ -259,11 +299,14 @@ class NetworkManager : public StaticSharedEbb<NetworkManager> {
     };
 
     void ReceiveArp(EthernetHeader& eh, std::unique_ptr<MutIOBuf> buf);
-    void ReceiveIp(EthernetHeader& eh, std::unique_ptr<MutIOBuf> buf);
+    void ReceiveIp(EthernetHeader& eh, std::unique_ptr<MutIOBuf> buf,
+                   RxInfo rinfo);
     void ReceiveIcmp(EthernetHeader& eh, Ipv4Header& ih,
                      std::unique_ptr<MutIOBuf> buf);
-    void ReceiveUdp(Ipv4Header& ih, std::unique_ptr<MutIOBuf> buf);
-    void ReceiveTcp(const Ipv4Header& ih, std::unique_ptr<MutIOBuf> buf);
+    void ReceiveUdp(Ipv4Header& ih, std::unique_ptr<MutIOBuf> buf,
+                    RxInfo rinfo);
+    void ReceiveTcp(const Ipv4Header& ih, std::unique_ptr<MutIOBuf> buf,
+                    RxInfo rinfo);
     void ReceiveDhcp(Ipv4Address from_addr, uint16_t from_port,
                      std::unique_ptr<MutIOBuf> buf);
     void EthArpSend(uint16_t proto, const Ipv4Header& ih,
@@ -18,6 +18,9 @@ uint16_t IpPseudoCsum(const IOBuf& buf, uint8_t proto, Ipv4Address src,
                       Ipv4Address dst);
 uint16_t IpCsum(const IOBuf& buf);
 uint16_t IpCsum(const uint8_t* buf, size_t len);
+// Copy the data of a chain to dst and return the checksum of the copied bytes
+// from csum_start on, computed during the copy
+uint16_t IpCsumCopy(uint8_t* dst, const IOBuf& buf, size_t csum_start = 0);
 }  // namespace ebbrt
 
 #endif  // BAREMETAL_SRC_INCLUDE_EBBRT_NETCHECKSUM_H_
@@ -0,0 +1,71 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef BAREMETAL_SRC_INCLUDE_EBBRT_NETGRO_H_
+#define BAREMETAL_SRC_INCLUDE_EBBRT_NETGRO_H_
+
+#include <array>
+#include <memory>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include <ebbrt/IOBuf.h>
+#include <ebbrt/Net.h>
+
+namespace ebbrt {
+// Receive offload for a batch of received packets. In order TCP segments of
+// the same flow are merged into one packet: the payloads are chained onto the
+// first segment and its headers are updated to cover them. Only segments with
+// a checksum the device validated are merged, as the merged packet's tcp
+// checksum is not recomputed. Everything else is passed to the interface as
+// is. Flush() must be called at the end of each batch, a segment is never held
+// across batches. Packets are only handed to the interface by Flush(), once
+// the batch is done with. A receive handler which blocks and lets another
+// batch through has the rest of its batch delivered ahead of the new one.
+class GenericReceiveOffload : boost::noncopyable {
+ public:
+  // Flows which can be merged concurrently within a batch
+  static const constexpr size_t kMaxFlows = 8;
+
+  struct Stats {
+    // segments merged into a previous segment of their flow
+    uint64_t merged{0};
+    // packets delivered to the interface
+    uint64_t delivered{0};
+  };
+
+  explicit GenericReceiveOffload(NetworkManager::Interface& itf) : itf_(itf) {}
+
+  void Receive(std::unique_ptr<MutIOBuf> buf, RxInfo rinfo);
+  void Flush();
+  const Stats& GetStats() const { return stats_; }
+
+ private:
+  struct Flow {
+    // first segment, with the payload of the following segments chained on
+    std::unique_ptr<MutIOBuf> buf;
+    // sequence number following the merged payload
+    uint32_t next_seq;
+    // ip length covering the merged payload
+    size_t ip_len;
+    size_t segments;
+  };
+
+  typedef std::pair<std::unique_ptr<MutIOBuf>, RxInfo> Packet;
+
+  void Deliver(std::unique_ptr<MutIOBuf> buf, RxInfo rinfo);
+  void FlushFlow(Flow& flow);
+
+  NetworkManager::Interface& itf_;
+  std::array<Flow, kMaxFlows> flows_;
+  // packets ready for the interface, in order, from out_next_ on
+  std::vector<Packet> out_;
+  size_t out_next_{0};
+  size_t next_evict_{0};
+  Stats stats_;
+};
+}  // namespace ebbrt
+
+#endif  // BAREMETAL_SRC_INCLUDE_EBBRT_NETGRO_H_
@@ -8,7 +8,7 @@
 #include <algorithm>
 
 #include <ebbrt/Debug.h>
-#include <ebbrt/IOBufRef.h>
+#include <ebbrt/LocalSharedIOBufRef.h>
 #include <ebbrt/Net.h>
 
 // A handler which implements the ITcpHandler interface for a
@@ -80,10 +80,9 @@ class TcpHandler : public ebbrt::NetworkManager::ITcpHandler {
           if (send_size > 0) {
             // If there is any space in the window, send what we can to buf to
             // be sent out and leave
-            // the rest in buf_
-            buf = ebbrt::CreateRef(*buf_);
-            buf->TrimEnd(len - send_size);  // trim off what won't fit
-            buf_->Advance(send_size);  // advance past what we will send out
+            // the rest in buf_. Both parts own a reference to the data, as
+            // the device may still be sending buf when buf_ is freed.
+            buf = ebbrt::SplitLocalSharedRef(buf_, send_size);
           }
           break;
         } else {
@@ -92,10 +91,7 @@ class TcpHandler : public ebbrt::NetworkManager::ITcpHandler {
           if (send_size > 0) {
             // If there is any space in the window, append what we can to buf to
             // be sent out and leave the rest in buf_
-            auto ref = ebbrt::CreateRef(*buf_);
-            ref->TrimEnd(len - send_size);
-            buf->PrependChain(std::move(ref));
-            buf_->Advance(send_size);
+            buf->PrependChain(ebbrt::SplitLocalSharedRef(buf_, send_size));
           }
           break;
         }
@@ -5,6 +5,8 @@
 #ifndef BAREMETAL_SRC_INCLUDE_EBBRT_NUMA_H_
 #define BAREMETAL_SRC_INCLUDE_EBBRT_NUMA_H_
 
+#include <array>
+
 #include <boost/container/static_vector.hpp>
 
 #include <ebbrt/ExplicitlyConstructed.h>
@@ -15,6 +17,9 @@ namespace ebbrt {
 namespace numa {
 const constexpr size_t kMaxNodes = 256;
 const constexpr size_t kMaxMemblocks = 256;
+// Default distances as defined by the ACPI SLIT
+const constexpr uint8_t kLocalDistance = 10;
+const constexpr uint8_t kRemoteDistance = 20;
 
 struct Memblock {
   Memblock(Pfn start, Pfn end, Nid nid) : start(start), end(end), nid(nid) {}
@@ -31,6 +36,9 @@ struct Node {
   boost::container::static_vector<Memblock, kMaxMemblocks> memblocks;
   Pfn pfn_start;
   Pfn pfn_end;
+  std::array<uint8_t, kMaxNodes> distances;
+  // All nodes in order of increasing distance, beginning with this one
+  boost::container::static_vector<Nid, kMaxNodes> fallback;
 };
 
 void EarlyInit();
@@ -38,6 +46,9 @@ void Init();
 Nid SetupNode(size_t proximity_domain);
 void MapApicToNode(size_t apic_id, Nid nid);
 void AddMemBlock(Nid nid, Pfn start, Pfn End);
+void SetPxmDistance(size_t from_pxm, size_t to_pxm, uint8_t distance);
+uint8_t Distance(Nid from, Nid to);
+const boost::container::static_vector<Nid, kMaxNodes>& FallbackOrder(Nid nid);
 
 extern ebbrt::ExplicitlyConstructed<
     boost::container::static_vector<Node, kMaxNodes>>
@@ -7,6 +7,8 @@
 
 // #define PAGE_CHECKER
 
+#include <atomic>
+
 #ifdef PAGE_CHECKER
 #include <boost/container/static_vector.hpp>
 #endif
@@ -31,9 +33,15 @@ class PageAllocator : public CacheAligned {
 
   static void Init();
   static PageAllocator& HandleFault(EbbId id);
+  // Allocate from nid, falling back to the nearest node with free memory
   Pfn Alloc(size_t order = 0, Nid nid = Cpu::GetMyNode(),
             uint64_t max_addr = UINT64_MAX);
+  // Allocate strictly from nid
+  Pfn AllocNoFallback(size_t order = 0, Nid nid = Cpu::GetMyNode(),
+                      uint64_t max_addr = UINT64_MAX);
   void Free(Pfn pfn, size_t order = 0);
+  // Number of allocations asked of this node that another node served
+  size_t remote_allocations() const { return remote_allocations_; }
 
  private:
   class FreePage {
@@ -78,6 +86,7 @@ class PageAllocator : public CacheAligned {
   SpinLock lock_;
   Nid nid_;
   std::array<FreePageList, kMaxOrder + 1> free_page_lists;
+  std::atomic<size_t> remote_allocations_;
 
 #ifdef PAGE_CHECKER
   struct Allocation {
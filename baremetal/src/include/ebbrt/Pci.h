@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <functional>
+#include <vector>
 
 #include <boost/optional.hpp>
 
@@ -109,6 +110,13 @@ class Device : public Function {
  public:
   Device(uint8_t bus, uint8_t device, uint8_t func);
 
+  // Configuration space offsets of every capability with the given id. Some,
+  // like vendor specific capabilities, may appear more than once.
+  std::vector<uint8_t> FindCapabilities(uint8_t capability) const;
+  // For drivers to read the capabilities found above
+  using Function::Read8;
+  using Function::Read32;
+
   bool MsixEnabled() const;
   Bar& GetBar(uint8_t idx);
   bool MsixEnable();
@@ -0,0 +1,88 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef BAREMETAL_SRC_INCLUDE_EBBRT_POOLEDIOBUF_H_
+#define BAREMETAL_SRC_INCLUDE_EBBRT_POOLEDIOBUF_H_
+
+#include <ebbrt/IOBuf.h>
+
+namespace ebbrt {
+class PooledIOBufOwner;
+
+typedef IOBufBase<PooledIOBufOwner> PooledIOBuf;
+typedef MutIOBufBase<PooledIOBufOwner> MutPooledIOBuf;
+
+// Like MakeUniqueIOBuf, the descriptor and data share one allocation, but the
+// allocation comes from a per core pool of fixed size packet buffers. Buffers
+// freed on another core are handed back to the core that allocated them.
+// Requests larger than the biggest pool class are allocated unpooled.
+std::unique_ptr<MutPooledIOBuf> MakePooledIOBuf(size_t capacity,
+                                                bool zero_memory = false);
+
+// Pooled equivalent of MakeUniqueIOBufWithHeadroom
+std::unique_ptr<MutPooledIOBuf>
+MakePooledIOBufWithHeadroom(size_t headroom, size_t length,
+                            bool zero_memory = false);
+
+class PooledIOBufOwner {
+ public:
+  const uint8_t* Buffer() const;
+  size_t Capacity() const;
+  // returns the buffer and descriptor(this) to their pool
+  void operator delete(void* ptr);
+
+ private:
+  // Private because it should not be called directly, use MakePooledIOBuf
+  PooledIOBufOwner(uint8_t* p, size_t capacity);
+
+  uint8_t* ptr_;
+  size_t capacity_;
+
+  friend class IOBufBase<PooledIOBufOwner>;
+  friend class MutIOBufBase<PooledIOBufOwner>;
+};
+
+// These template specializations ensure that the private constructor remains
+// hidden
+template <>
+class IOBufBase<PooledIOBufOwner> : public PooledIOBufOwner, public IOBuf {
+ public:
+  const uint8_t* Buffer() const override { return PooledIOBufOwner::Buffer(); }
+
+  size_t Capacity() const override { return PooledIOBufOwner::Capacity(); }
+
+ private:
+  IOBufBase(uint8_t* p, size_t capacity)
+      : PooledIOBufOwner(p, capacity), IOBuf(p, capacity) {}
+
+  friend std::unique_ptr<MutPooledIOBuf>
+  ebbrt::MakePooledIOBuf(size_t capacity, bool zero_memory);
+};
+
+template <>
+class MutIOBufBase<PooledIOBufOwner> : public PooledIOBufOwner,
+                                       public MutIOBuf {
+ public:
+  const uint8_t* Buffer() const override { return PooledIOBufOwner::Buffer(); }
+
+  size_t Capacity() const override { return PooledIOBufOwner::Capacity(); }
+
+ private:
+  MutIOBufBase(uint8_t* p, size_t capacity)
+      : PooledIOBufOwner(p, capacity), MutIOBuf(p, capacity) {}
+
+  friend std::unique_ptr<MutPooledIOBuf>
+  ebbrt::MakePooledIOBuf(size_t capacity, bool zero_memory);
+};
+
+const constexpr size_t kPooledIOBufHeaderSize = 16;
+
+// Largest capacity which fits in a pool block of block_size bytes, e.g. to
+// size buffers to exactly a page
+constexpr size_t PooledIOBufCapacity(size_t block_size) {
+  return block_size - kPooledIOBufHeaderSize - sizeof(MutPooledIOBuf);
+}
+}  // namespace ebbrt
+
+#endif  // BAREMETAL_SRC_INCLUDE_EBBRT_POOLEDIOBUF_H_
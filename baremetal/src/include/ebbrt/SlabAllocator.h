@@ -49,6 +49,8 @@ class SlabCache {
   std::atomic<bool> remote_check;
 
  private:
+  size_t next_color_;
+
   struct PageHookFunctor {
     typedef boost::intrusive::list_member_hook<
         boost::intrusive::link_mode<boost::intrusive::normal_link>>
@@ -113,14 +115,19 @@ class SlabAllocator : public CacheAligned {
   void* Alloc();
   void* AllocNid(Nid nid = Cpu::GetMyNode());
   void Free(void* p);
+  // Number of allocations served by a node other than the one asked for
+  size_t remote_allocations() const { return remote_allocations_; }
 
  private:
+  void* AllocLocal();
+  void* AllocFallback(Nid nid);
   void FreeRemote(void* p);
   void FlushRemoteList();
 
   SlabCache cache_;
   FreeObjectList remote_list_;
   SlabCache* remote_cache_;
+  size_t remote_allocations_;
 
   friend class SlabCache;
   friend class SlabAllocatorRoot;
@@ -145,7 +152,11 @@ class SlabAllocatorNode : public CacheAligned {
 
 class SlabAllocatorRoot {
  public:
-  explicit SlabAllocatorRoot(size_t size, size_t align = 0);
+  // With coloring, the objects of successive slabs start at different offsets
+  // into the slab's unused space so that objects at the same index do not map
+  // to the same cache sets
+  explicit SlabAllocatorRoot(size_t size, size_t align = 0,
+                             bool coloring = true);
   ~SlabAllocatorRoot();
 
   void* operator new(size_t size);
@@ -159,6 +170,8 @@ class SlabAllocatorRoot {
   size_t order() const { return order_; }
   size_t free_batch() const { return free_batch_; }
   size_t hiwater() const { return hiwater_; }
+  size_t color_step() const { return color_step_; }
+  size_t num_colors() const { return num_colors_; }
 
  private:
   size_t align_;
@@ -166,6 +179,8 @@ class SlabAllocatorRoot {
   size_t order_;
   size_t free_batch_;
   size_t hiwater_;
+  size_t color_step_;
+  size_t num_colors_;
   // TODO(dschatz): atomic_unique_ptr?
   std::array<std::atomic<SlabAllocatorNode*>, numa::kMaxNodes> node_allocators_;
   std::array<std::unique_ptr<SlabAllocator>, Cpu::kMaxCpus> cpu_allocators_;
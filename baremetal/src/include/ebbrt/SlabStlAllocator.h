@@ -0,0 +1,85 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef BAREMETAL_SRC_INCLUDE_EBBRT_SLABSTLALLOCATOR_H_
+#define BAREMETAL_SRC_INCLUDE_EBBRT_SLABSTLALLOCATOR_H_
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <ebbrt/Compiler.h>
+#include <ebbrt/SlabAllocator.h>
+
+namespace ebbrt {
+// STL allocator for node based containers. Single object allocations (the
+// nodes) come from a slab allocator dedicated to T, which skips the gp
+// allocator's size class dispatch and keeps nodes of a type together. Arrays
+// (e.g. hash table buckets) fall back to malloc.
+template <typename T> class SlabStlAllocator {
+ public:
+  typedef T value_type;
+
+  SlabStlAllocator() noexcept {}
+  template <typename U>
+  SlabStlAllocator(const SlabStlAllocator<U>& other) noexcept {}
+
+  T* allocate(size_t n) {
+    void* ret;
+    if (likely(n == 1)) {
+      ret = Root().GetCpuAllocator().Alloc();
+    } else {
+      ret = malloc(n * sizeof(T));
+    }
+    if (ret == nullptr)
+      throw std::bad_alloc();
+    return static_cast<T*>(ret);
+  }
+
+  void deallocate(T* p, size_t n) noexcept {
+    if (likely(n == 1)) {
+      Root().GetCpuAllocator().Free(p);
+    } else {
+      free(p);
+    }
+  }
+
+ private:
+  static SlabAllocatorRoot& Root() {
+    auto root = root_.load(std::memory_order_acquire);
+    if (unlikely(root == nullptr))
+      root = CreateRoot();
+    return *root;
+  }
+
+  static SlabAllocatorRoot* CreateRoot() {
+    auto root = new SlabAllocatorRoot(sizeof(T), alignof(T));
+    SlabAllocatorRoot* expected = nullptr;
+    if (!root_.compare_exchange_strong(expected, root,
+                                       std::memory_order_acq_rel)) {
+      // another core created it first
+      delete root;
+      return expected;
+    }
+    return root;
+  }
+
+  static std::atomic<SlabAllocatorRoot*> root_;
+};
+
+template <typename T>
+std::atomic<SlabAllocatorRoot*> SlabStlAllocator<T>::root_{nullptr};
+
+template <typename T, typename U>
+bool operator==(const SlabStlAllocator<T>&, const SlabStlAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SlabStlAllocator<T>&, const SlabStlAllocator<U>&) {
+  return false;
+}
+}  // namespace ebbrt
+
+#endif  // BAREMETAL_SRC_INCLUDE_EBBRT_SLABSTLALLOCATOR_H_
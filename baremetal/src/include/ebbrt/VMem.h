@@ -6,6 +6,7 @@
 #define BAREMETAL_SRC_INCLUDE_EBBRT_VMEM_H_
 
 #include <algorithm>
+#include <functional>
 
 #include <ebbrt/PMem.h>
 #include <ebbrt/Pfn.h>
@@ -20,6 +21,17 @@ class Pte {
 
   Pte() { Clear(); }
   explicit Pte(uint64_t raw) : raw_(raw) {}
+  // Install entry unless this one became present, for page table pages that
+  // concurrent faults may race to create
+  bool SetIfNotPresent(Pte entry) {
+    auto expected = __atomic_load_n(&raw_, __ATOMIC_ACQUIRE);
+    while (!(expected & 1)) {
+      if (__atomic_compare_exchange_n(&raw_, &expected, entry.raw_, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return true;
+    }
+    return false;
+  }
   bool Present() const { return raw_ & 1; }
   uint64_t Addr(bool large) const {
     auto ret = raw_ & ((UINT64_C(1) << 52) - 1);
@@ -66,6 +78,18 @@ class Pte {
 
 // TODO(dschatz): support 1g pages
 const constexpr size_t kNumPageSizes = 2;
+const constexpr size_t kLargePageOrder = 9;
+const constexpr size_t kLargePageSize = pmem::kPageSize << kLargePageOrder;
+
+// Physical memory is identity mapped below this address. Above it are the
+// regions of the vmem allocator, whose pages may be anywhere.
+const constexpr uintptr_t kIdentityMapEnd = 0xFFFF800000000000;
+
+// Whether addr is also the physical address of the memory behind it, so it
+// can be handed to a device as is
+inline bool IdentityMapped(const void* addr) {
+  return reinterpret_cast<uintptr_t>(addr) < kIdentityMapEnd;
+}
 
 inline size_t PtIndex(uintptr_t virt_addr, size_t level) {
   return (virt_addr >> (12 + level * 9)) & ((1 << 9) - 1);
@@ -108,7 +132,20 @@ void EnableRuntimePageTable();
 void EarlyMapMemory(uint64_t addr, uint64_t length);
 void EarlyUnmapMemory(uint64_t addr, uint64_t length);
 void MapMemory(Pfn vfn, Pfn pfn, uint64_t length = pmem::kPageSize);
+// Back [vfn, vfn + npages) with freshly allocated 2MB pages
+void MapLargePages(Pfn vfn, size_t npages);
+// Unmap a region mapped by MapLargePages. The backing pages and the virtual
+// region are released once every core has flushed the range from its TLB.
+void UnmapLargePages(Pfn vfn, size_t npages);
+// Clear whatever is mapped in [vfn, vfn + npages), then call done once every
+// core has flushed the range from its TLB. Large pages must lie entirely
+// inside the range. The mapped memory is not freed, except for page table
+// pages the range covers entirely.
+void UnmapMemory(Pfn vfn, size_t npages, std::function<void()> done);
 void ApInit(size_t index);
+// Populate the top level entries covering [vfn, vfn + npages) so the
+// mappings beneath them are shared by every core's copy of the page table
+void MapTopLevel(Pfn vfn, size_t npages);
 
 Pte& GetPageTableRoot();
 
@@ -5,11 +5,15 @@
 #ifndef BAREMETAL_SRC_INCLUDE_EBBRT_VMEMALLOCATOR_H_
 #define BAREMETAL_SRC_INCLUDE_EBBRT_VMEMALLOCATOR_H_
 
+#include <array>
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
+#include <vector>
 
 #include <ebbrt/CacheAligned.h>
+#include <ebbrt/Cpu.h>
 #include <ebbrt/Debug.h>
 #include <ebbrt/EbbRef.h>
 #include <ebbrt/Idt.h>
@@ -36,6 +40,11 @@ class VMemAllocator : CacheAligned {
   Pfn Alloc(size_t npages, size_t pages_align,
             std::unique_ptr<PageFaultHandler> pf_handler = nullptr);
 
+  // Release the allocated region beginning at vfn
+  void Free(Pfn vfn);
+  // Number of pages in the allocated region beginning at vfn
+  size_t RegionPages(Pfn vfn);
+
  private:
   class Region {
    public:
@@ -58,11 +67,75 @@ class VMemAllocator : CacheAligned {
     bool allocated_;
   };
 
+  // Regions of up to kArenaSlotPages (an event stack) are carved out of per
+  // core arenas. Arena chunks are split into equally sized slots so the region
+  // covering a faulting address is found by indexing, without taking a lock.
+  // Regions of up to kSmallSlotPages, such as most mmio bars, come from chunks
+  // of smaller slots rather than taking a stack sized one.
+  static const constexpr size_t kSmallSlotPages = 64;
+  static const constexpr size_t kArenaSlotPages = 2048;
+  static const constexpr size_t kArenaClasses = 2;
+  static const constexpr size_t kArenaChunkPages = kArenaSlotPages * 512;
+  static const constexpr size_t kMaxArenaChunks = 1024;
+
+  static constexpr size_t SlotPages(size_t cls) {
+    return cls == 0 ? kSmallSlotPages : kArenaSlotPages;
+  }
+
+  struct ArenaSlot {
+    ArenaSlot() : handler(nullptr), npages(0) {}
+    std::atomic<PageFaultHandler*> handler;
+    // read by the fault path without the arena lock, while Free() clears it
+    std::atomic<size_t> npages;
+  };
+
+  struct ArenaChunk {
+    ArenaChunk(size_t cpu, size_t cls)
+        : cpu(cpu), cls(cls), slot_pages(SlotPages(cls)),
+          slots(new ArenaSlot[kArenaChunkPages / slot_pages]) {}
+    // offset is in pages from the start of the arena
+    ArenaSlot& Slot(size_t offset) {
+      return slots[offset % kArenaChunkPages / slot_pages];
+    }
+    size_t SlotStart(size_t offset) const {
+      return offset / slot_pages * slot_pages;
+    }
+    size_t cpu;
+    size_t cls;
+    size_t slot_pages;
+    std::unique_ptr<ArenaSlot[]> slots;
+  };
+
+  class Arena : public CacheAligned {
+   public:
+    Arena() : chunk(kMaxArenaChunks), next_slot(0) {}
+    SpinLock lock;
+    std::vector<Pfn> free_slots;
+    size_t chunk;
+    size_t next_slot;
+  };
+
   VMemAllocator();
+  // Smallest arena class whose slots fit the region, kArenaClasses if none
+  static size_t ArenaClass(size_t npages, size_t pages_align);
+  Pfn AllocArena(size_t npages, size_t cls,
+                 std::unique_ptr<PageFaultHandler> pf_handler);
+  Pfn AllocRegion(size_t npages, std::unique_ptr<PageFaultHandler> pf_handler);
+  Pfn AllocRegion(size_t npages, size_t pages_align,
+                  std::unique_ptr<PageFaultHandler> pf_handler);
+  bool InArena(Pfn vfn) const {
+    return vfn >= arena_start_ &&
+           vfn < arena_start_ + kMaxArenaChunks * kArenaChunkPages;
+  }
+  ArenaChunk* FindChunk(Pfn vfn);
   void HandlePageFault(idt::ExceptionFrame* ef);
 
   SpinLock lock_;
   std::map<Pfn, Region, std::greater<Pfn>> regions_;
+  Pfn arena_start_;
+  std::atomic<size_t> next_chunk_;
+  std::array<std::atomic<ArenaChunk*>, kMaxArenaChunks> chunks_;
+  std::array<std::array<Arena, kArenaClasses>, Cpu::kMaxCpus> arenas_;
 
   friend void ebbrt::idt::PageFaultException(ExceptionFrame* ef);
 };
@@ -6,6 +6,7 @@
 #define BAREMETAL_SRC_INCLUDE_EBBRT_VIRTIO_H_
 
 #include <atomic>
+#include <cinttypes>
 #include <cstdint>
 #include <limits>
 #include <list>
@@ -20,6 +21,7 @@
 #include <ebbrt/PageAllocator.h>
 #include <ebbrt/Pci.h>
 #include <ebbrt/Pfn.h>
+#include <ebbrt/VMem.h>
 
 namespace ebbrt {
 
@@ -27,7 +29,8 @@ template <typename VirtType> class VirtioDriver {
  public:
   static bool Probe(pci::Device& dev) {
     if (dev.GetVendorId() == kVirtioVendorId &&
-        dev.GetDeviceId() == VirtType::kDeviceId) {
+        (dev.GetDeviceId() == VirtType::kDeviceId ||
+         dev.GetDeviceId() == VirtType::kModernDeviceId)) {
       dev.DumpAddress();
       VirtType::Create(dev);
       return true;
@@ -38,6 +41,7 @@ template <typename VirtType> class VirtioDriver {
  protected:
   static const constexpr uint16_t kVirtioVendorId = 0x1AF4;
 
+  // Legacy transport, the registers are at the start of bar 0
   static const constexpr size_t kDeviceFeatures = 0;
   static const constexpr size_t kGuestFeatures = 4;
   static const constexpr size_t kQueueAddress = 8;
@@ -48,24 +52,68 @@ template <typename VirtType> class VirtioDriver {
   static const constexpr size_t kQueueVector = 22;
   static const constexpr size_t kDeviceConfiguration = 24;
 
+  // Modern (virtio 1.0) transport, vendor specific pci capabilities say where
+  // each group of registers is
+  static const constexpr uint8_t kPciCapVendor = 0x09;
+  static const constexpr uint8_t kPciCapCfgType = 3;
+  static const constexpr uint8_t kPciCapBar = 4;
+  static const constexpr uint8_t kPciCapOffset = 8;
+  static const constexpr uint8_t kPciCapNotifyMultiplier = 16;
+
+  static const constexpr uint8_t kPciCapCommonCfg = 1;
+  static const constexpr uint8_t kPciCapNotifyCfg = 2;
+  static const constexpr uint8_t kPciCapDeviceCfg = 4;
+
+  static const constexpr size_t kCommonDeviceFeatureSelect = 0;
+  static const constexpr size_t kCommonDeviceFeature = 4;
+  static const constexpr size_t kCommonDriverFeatureSelect = 8;
+  static const constexpr size_t kCommonDriverFeature = 12;
+  static const constexpr size_t kCommonDeviceStatus = 20;
+  static const constexpr size_t kCommonQueueSelect = 22;
+  static const constexpr size_t kCommonQueueSize = 24;
+  static const constexpr size_t kCommonQueueVector = 26;
+  static const constexpr size_t kCommonQueueEnable = 28;
+  static const constexpr size_t kCommonQueueNotifyOff = 30;
+  static const constexpr size_t kCommonQueueDesc = 32;
+  static const constexpr size_t kCommonQueueDriver = 40;
+  static const constexpr size_t kCommonQueueDevice = 48;
+
   static const constexpr uint8_t kConfigAcknowledge = 1;
   static const constexpr uint8_t kConfigDriver = 2;
   static const constexpr uint8_t kConfigDriverOk = 4;
+  static const constexpr uint8_t kConfigFeaturesOk = 8;
 
   static const constexpr int kQueueAddressShift = 12;
 
+  static const constexpr int kVirtioRingIndirectDesc = 28;
   static const constexpr int kVirtioRingEventIdx = 29;
+  static const constexpr int kVirtioVersion1 = 32;
+  static const constexpr int kVirtioRingPacked = 34;
 
+  // A virtqueue, either a split ring or, if VIRTIO_F_RING_PACKED was
+  // negotiated, a packed ring. Both are driven through the same interface.
   class VRing {
    public:
-    VRing(VirtioDriver<VirtType>& driver, uint16_t qsize, size_t idx, Nid nid)
-        : driver_(driver), idx_(idx), qsize_(qsize), last_used_(0),
-          avail_idx_(0), used_head_(0), free_head_(0), free_count_(qsize_),
-          buf_references_(qsize_), event_indexes_(false) {
-      auto sz =
-          align::Up(sizeof(Desc) * qsize + sizeof(uint16_t) * (3 + qsize),
-                    4096) +
-          align::Up(sizeof(uint16_t) * 3 + sizeof(UsedElem) * qsize, 4096);
+    // With indirect descriptors, chains of up to this many buffers take a
+    // single descriptor in the ring
+    static const constexpr size_t kMaxIndirect = 32;
+
+    VRing(VirtioDriver<VirtType>& driver, uint16_t qsize, size_t idx, Nid nid,
+          bool packed)
+        : driver_(driver), idx_(idx), nid_(nid), qsize_(qsize), last_used_(0),
+          avail_idx_(0), notified_idx_(0), used_head_(0), free_head_(0),
+          free_count_(qsize_), next_avail_(0), avail_wrap_(true),
+          used_wrap_(true), buf_references_(qsize_), packed_(packed),
+          event_indexes_(false), interrupts_(true) {
+      size_t sz;
+      if (packed_) {
+        sz = align::Up(sizeof(PackedDesc) * qsize + sizeof(EventSuppress) * 2,
+                       4096);
+      } else {
+        sz = align::Up(sizeof(Desc) * qsize + sizeof(uint16_t) * (3 + qsize),
+                       4096) +
+             align::Up(sizeof(uint16_t) * 3 + sizeof(UsedElem) * qsize, 4096);
+      }
       auto order = Fls(sz - 1) - pmem::kPageShift + 1;
       auto page = page_allocator->Alloc(order, nid);
       kbugon(page == Pfn::None(), "virtio: page allocation failed");
@@ -73,6 +121,24 @@ template <typename VirtType> class VirtioDriver {
       addr_ = reinterpret_cast<void*>(page.ToAddr());
       memset(addr_, 0, sz);
 
+      if (packed_) {
+        // The descriptors are the whole ring, followed by the structures the
+        // driver and device use to suppress each other's notifications. A
+        // zeroed descriptor is owned by the driver with both wrap counters
+        // starting at one.
+        packed_desc_ = static_cast<PackedDesc*>(addr_);
+        driver_event_ =
+            reinterpret_cast<EventSuppress*>(&packed_desc_[qsize_]);
+        device_event_ = driver_event_ + 1;
+
+        // buffer ids are handed out from a free list
+        id_next_.resize(qsize_);
+        id_descs_.resize(qsize_);
+        for (unsigned i = 0; i < qsize_; ++i)
+          id_next_[i] = i + 1;
+        return;
+      }
+
       desc_ = static_cast<Desc*>(addr_);
       avail_ = static_cast<Avail*>(static_cast<void*>(
           static_cast<char*>(addr_) + qsize_ * sizeof(Desc)));
@@ -94,15 +160,43 @@ template <typename VirtType> class VirtioDriver {
 
     void* addr() { return addr_; }
 
+    // The three areas of the ring, the modern transport takes each separately
+    void* desc_addr() { return addr_; }
+    void* driver_addr() {
+      return packed_ ? static_cast<void*>(driver_event_)
+                     : static_cast<void*>(avail_);
+    }
+    void* device_addr() {
+      return packed_ ? static_cast<void*>(device_event_)
+                     : static_cast<void*>(used_);
+    }
+
     size_t num_free_descriptors() { return free_count_; }
 
+    // Only call before any buffers are added. With event indexes, the device
+    // is only notified when it asked for the buffers being added and
+    // interrupts are moderated with the used event index rather than flags.
+    void EnableEventIndexes() { event_indexes_ = true; }
+
+    // Only call before any buffers are added
+    void EnableIndirectDescriptors() {
+      if (packed_) {
+        packed_indirect_ = AllocIndirect<PackedDesc>();
+      } else {
+        indirect_ = AllocIndirect<Desc>();
+      }
+    }
+
+    // Number of ring descriptors AddBuffer() takes for a chain of len buffers
+    size_t DescriptorsNeeded(size_t len) const {
+      return UseIndirect(len) ? 1 : len;
+    }
+
     template <typename Iterator>
     Iterator AddWritableBuffers(Iterator begin, Iterator end) {
       if (begin == end)
         return end;
       auto count = 0;
-      // auto orig_idx = avail_->idx.load(std::memory_order_relaxed);
-      auto orig_idx = avail_idx_;
       for (auto it = begin; it < end; ++it) {
         ++count;
         auto& buf_chain = *it;
@@ -111,6 +205,11 @@ template <typename VirtType> class VirtioDriver {
         if (chain_len > free_count_)
           return it;
 
+        if (packed_) {
+          AddPacked(std::move(buf_chain), chain_len, 0);
+          continue;
+        }
+
         // allocate the free descriptors
         free_count_ -= chain_len;
         uint16_t last_desc = free_head_;
@@ -118,6 +217,7 @@ template <typename VirtType> class VirtioDriver {
         for (auto& buf : *buf_chain) {
           // for each buffer in this list, write it to a descriptor
           auto& desc = desc_[free_head_];
+          kassert(vmem::IdentityMapped(buf.Data()));
           desc.addr = reinterpret_cast<uint64_t>(buf.Data());
           desc.len = static_cast<uint32_t>(buf.Length());
           desc.flags |= Desc::Write | Desc::Next;
@@ -135,84 +235,141 @@ template <typename VirtType> class VirtioDriver {
       }
       // notify the device of the descriptor chains we added
 
-      // ensure that all our writes to the descriptors and available ring have
-      // completed
-      std::atomic_thread_fence(std::memory_order_release);
-
-      // give the device ownership of the added descriptor chains
-      // note this need not have any memory ordering due to the preceding fence
-      avail_->idx.store(avail_idx_, std::memory_order_relaxed);
-
-      // ensure that the previous write is seen before we detect if we must
-      // notify the device. This ordering is to guarantee that the following
-      // loads won't be ordered before the fence.
-      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!packed_) {
+        // ensure that all our writes to the descriptors and available ring
+        // have completed
+        std::atomic_thread_fence(std::memory_order_release);
 
-      if (event_indexes_) {
-        auto event_idx = avail_event_->load(std::memory_order_relaxed);
-        if ((uint16_t)(avail_idx_ - event_idx - 1) <
-            (uint16_t)(avail_idx_ - orig_idx)) {
-          Kick();
-        }
-      } else if (!(used_->flags.load(std::memory_order_consume) &
-                   Used::kNoNotify)) {
-        Kick();
+        // give the device ownership of the added descriptor chains
+        // note this need not have any memory ordering due to the preceding
+        // fence
+        avail_->idx.store(avail_idx_, std::memory_order_relaxed);
       }
 
+      Flush();
+
       return end;
     }
 
-    void AddBuffer(std::unique_ptr<IOBuf> bufs, size_t out_num) {
+    // The device is given each buffer by address, so they must all be in
+    // identity mapped memory. If more is set, the device is not notified and
+    // Flush() must be called once the last buffer of the batch has been added.
+    // The buffers are visible to the device either way, it may pick them up if
+    // it is running.
+    void AddBuffer(std::unique_ptr<IOBuf> bufs, size_t out_num,
+                   bool more = false) {
       auto len = bufs->CountChainElements();
-      kassert(free_count_ >= len);
+      if (packed_) {
+        kassert(free_count_ >= DescriptorsNeeded(len));
+        AddPacked(std::move(bufs), len, out_num);
+        if (!more)
+          Flush();
+        return;
+      }
 
-      free_count_ -= len;
-      uint16_t last_desc = free_head_;
       uint16_t head = free_head_;
-      for (const auto& buf : *bufs) {
-        auto addr = buf.Data();
-        auto size = buf.Length();
-        auto& desc = desc_[free_head_];
-        desc.addr = reinterpret_cast<uint64_t>(addr);
-        desc.len = size;
-        desc.flags |= Desc::Next;
-        if (out_num == 0) {
-          desc.flags |= Desc::Write;
-        } else {
-          --out_num;
+      if (UseIndirect(len)) {
+        kassert(free_count_ >= 1);
+
+        // describe the chain in the head's indirect table, which is the only
+        // descriptor put in the ring
+        auto table = &indirect_[head * kMaxIndirect];
+        uint16_t i = 0;
+        for (const auto& buf : *bufs) {
+          auto& desc = table[i];
+          kassert(vmem::IdentityMapped(buf.Data()));
+          desc.addr = reinterpret_cast<uint64_t>(buf.Data());
+          desc.len = buf.Length();
+          desc.flags = Desc::Next;
+          if (out_num == 0) {
+            desc.flags |= Desc::Write;
+          } else {
+            --out_num;
+          }
+          desc.next = ++i;
         }
-        last_desc = free_head_;
+        table[i - 1].flags &= ~Desc::Next;
+
+        auto& desc = desc_[head];
+        desc.addr = reinterpret_cast<uint64_t>(table);
+        desc.len = len * sizeof(Desc);
+        desc.flags = Desc::Indirect;
+        --free_count_;
         free_head_ = desc.next;
+      } else {
+        kassert(free_count_ >= len);
+
+        free_count_ -= len;
+        uint16_t last_desc = free_head_;
+        for (const auto& buf : *bufs) {
+          auto addr = buf.Data();
+          auto size = buf.Length();
+          auto& desc = desc_[free_head_];
+          kassert(vmem::IdentityMapped(addr));
+          desc.addr = reinterpret_cast<uint64_t>(addr);
+          desc.len = size;
+          // a descriptor may have been an indirect one before, so set every
+          // flag
+          desc.flags = Desc::Next;
+          if (out_num == 0) {
+            desc.flags |= Desc::Write;
+          } else {
+            --out_num;
+          }
+          last_desc = free_head_;
+          free_head_ = desc.next;
+        }
+        desc_[last_desc].flags &= ~Desc::Next;
       }
-      desc_[last_desc].flags &= ~Desc::Next;
 
-      // auto avail_idx = avail_->idx.load(std::memory_order_relaxed);
-      auto orig_idx = avail_idx_;
       avail_->ring[avail_idx_ % qsize_] = head;
       ++avail_idx_;
+      kassert(head < qsize_);
+      buf_references_[head] = std::move(bufs);
 
       std::atomic_thread_fence(std::memory_order_release);
 
       avail_->idx.store(avail_idx_, std::memory_order_relaxed);
 
+      if (!more)
+        Flush();
+    }
+
+    // Notify the device of the buffers added since the last notification, if
+    // it asked to be
+    void Flush() {
+      if (notified_idx_ == avail_idx_)
+        return;
+
+      // ensure that the avail index write is seen before we detect if we must
+      // notify the device. This ordering is to guarantee that the following
+      // loads won't be ordered before the fence.
       std::atomic_thread_fence(std::memory_order_seq_cst);
 
-      if (event_indexes_) {
+      if (packed_) {
+        if (PackedNeedsKick())
+          Kick();
+      } else if (event_indexes_) {
         auto event_idx = avail_event_->load(std::memory_order_relaxed);
         if ((uint16_t)(avail_idx_ - event_idx - 1) <
-            (uint16_t)(avail_idx_ - orig_idx)) {
+            (uint16_t)(avail_idx_ - notified_idx_)) {
           Kick();
         }
       } else if (!(used_->flags.load(std::memory_order_consume) &
                    Used::kNoNotify)) {
         Kick();
       }
-
-      kassert(head < qsize_);
-      buf_references_[head] = std::move(bufs);
+      notified_idx_ = avail_idx_;
     }
 
     bool HasUsedBuffer() {
+      if (packed_) {
+        auto flags =
+            packed_desc_[last_used_].flags.load(std::memory_order_acquire);
+        return ((flags & PackedDesc::Avail) != 0) == used_wrap_ &&
+               ((flags & PackedDesc::Used) != 0) == used_wrap_;
+      }
+
       if (last_used_ == used_head_) {
         used_head_ = used_->idx.load(std::memory_order_consume);
         if (last_used_ == used_head_)
@@ -222,101 +379,83 @@ template <typename VirtType> class VirtioDriver {
     }
 
     std::unique_ptr<IOBuf> GetBuffer() {
-      auto& elem = used_->ring[last_used_ % qsize_];
-      kassert(buf_references_[elem.id]);
-      // This const cast is needed to trim the buffer chain
-      auto buf = std::move(buf_references_[elem.id]);
-      Desc* descriptor = &desc_[elem.id];
-      auto len = 1;
-      while (descriptor->flags & Desc::Next) {
-        ++len;
-        descriptor = &desc_[descriptor->next];
-      }
-      descriptor->next = free_head_;
-      free_head_ = elem.id;
-      free_count_ += len;
-      ++last_used_;
-
-      // trim the buffer chain to only include the actual size
-      auto packet_len = elem.len;
-      for (auto& b : *buf) {
-        auto blen = b.Length();
-        if (blen > packet_len) {
-          b.TrimEnd(blen - packet_len);
-          packet_len = 0;
-        } else {
-          packet_len -= blen;
-        }
-      }
-
-      kassert(buf->ComputeChainDataLength() == elem.len);
-
-      return std::move(buf);
+      uint32_t len;
+      auto buf = PopUsed(len);
+      TrimChain(*buf, len);
+      return buf;
     }
 
     void ClearUsedBuffers() {
-      used_head_ = used_->idx.load(std::memory_order_relaxed);
-      while (last_used_ != used_head_) {
-        auto& elem = used_->ring[last_used_ % qsize_];
-        kassert(buf_references_[elem.id]);
-        buf_references_[elem.id].reset();
-        Desc* descriptor = &desc_[elem.id];
-        auto len = 1;
-        while (descriptor->flags & Desc::Next) {
-          ++len;
-          descriptor = &desc_[descriptor->next];
-        }
-        descriptor->next = free_head_;
-        free_head_ = elem.id;
-        free_count_ += len;
-        ++last_used_;
+      while (HasUsedBuffer()) {
+        uint32_t len;
+        PopUsed(len);
       }
+      if (event_indexes_ && !interrupts_)
+        SuppressUsedEvent();
     }
 
-    template <typename F> void ProcessUsedBuffers(F&& f) {
-      used_head_ = used_->idx.load(std::memory_order_relaxed);
-      while (last_used_ != used_head_) {
-        auto& elem = used_->ring[last_used_ % qsize_];
-        kassert(buf_references_[elem.id]);
-        auto& buf = buf_references_[elem.id];
-        Desc* descriptor = &desc_[elem.id];
-        auto len = 1;
-        while (descriptor->flags & Desc::Next) {
-          ++len;
-          descriptor = &desc_[descriptor->next];
-        }
-        descriptor->next = free_head_;
-        free_head_ = elem.id;
-        free_count_ += len;
-        ++last_used_;
-
-        auto packet_len = elem.len;
-        for (auto& b : *buf) {
-          auto blen = b.Length();
-          if (blen > packet_len) {
-            b.TrimEnd(blen - packet_len);
-            packet_len = 0;
-          } else {
-            packet_len -= blen;
-          }
-        }
-
-        kassert(buf->ComputeChainDataLength() == elem.len);
+    // Pass up to max used buffers to f, returns the number passed
+    template <typename F>
+    size_t ProcessUsedBuffers(F&& f,
+                              size_t max = std::numeric_limits<size_t>::max()) {
+      size_t processed = 0;
+      while (processed < max && HasUsedBuffer()) {
+        ++processed;
+        uint32_t len;
+        auto buf = PopUsed(len);
+        TrimChain(*buf, len);
         // cast from non mut to mut, we know that a used buffer was mutable
         f(std::unique_ptr<MutIOBuf>(static_cast<MutIOBuf*>(buf.release())));
       }
+      if (event_indexes_ && !interrupts_)
+        SuppressUsedEvent();
+      return processed;
     }
 
     uint16_t Size() const { return qsize_; }
 
-    void Kick() { driver_.Kick(idx_); }
+    void Kick() {
+      ++kicks_;
+      driver_.Kick(idx_);
+    }
+
+    // Number of times the device was notified, each one is a VM exit
+    uint64_t NumKicks() const { return kicks_; }
 
     void EnableInterrupts() {
-      avail_->flags.store(0, std::memory_order_release);
+      interrupts_ = true;
+      if (packed_) {
+        if (event_indexes_) {
+          // interrupt when the next buffer is used
+          driver_event_->off_wrap.store(last_used_ | used_wrap_ << 15,
+                                        std::memory_order_relaxed);
+          driver_event_->flags.store(EventSuppress::kDesc,
+                                     std::memory_order_release);
+        } else {
+          driver_event_->flags.store(EventSuppress::kEnable,
+                                     std::memory_order_relaxed);
+        }
+      } else if (event_indexes_) {
+        // interrupt when the next buffer is used
+        used_event_->store(last_used_, std::memory_order_relaxed);
+      } else {
+        avail_->flags.store(0, std::memory_order_relaxed);
+      }
+      // Callers check for used buffers next to avoid missing an interrupt, that
+      // load must not be ordered before the store
+      std::atomic_thread_fence(std::memory_order_seq_cst);
     }
 
     void DisableInterrupts() {
-      avail_->flags.store(Avail::kNoInterrupt, std::memory_order_release);
+      interrupts_ = false;
+      if (packed_) {
+        driver_event_->flags.store(EventSuppress::kDisable,
+                                   std::memory_order_release);
+      } else if (event_indexes_) {
+        SuppressUsedEvent();
+      } else {
+        avail_->flags.store(Avail::kNoInterrupt, std::memory_order_release);
+      }
     }
 
    private:
@@ -352,30 +491,262 @@ template <typename VirtType> class VirtioDriver {
       UsedElem ring[];
     };
 
+    // Packed ring descriptor, also used for its indirect tables. Ownership of
+    // a descriptor is given by its Avail and Used flags relative to the wrap
+    // counter of whoever is looking at it.
+    struct PackedDesc {
+      static const constexpr uint16_t Next = 1;
+      static const constexpr uint16_t Write = 2;
+      static const constexpr uint16_t Indirect = 4;
+      static const constexpr uint16_t Avail = 1 << 7;
+      static const constexpr uint16_t Used = 1 << 15;
+
+      uint64_t addr;
+      uint32_t len;
+      uint16_t id;
+      std::atomic<uint16_t> flags;
+    };
+
+    struct EventSuppress {
+      static const constexpr uint16_t kEnable = 0;
+      static const constexpr uint16_t kDisable = 1;
+      // notify when the ring reaches off_wrap, needs event indexes
+      static const constexpr uint16_t kDesc = 2;
+
+      std::atomic<uint16_t> off_wrap;
+      std::atomic<uint16_t> flags;
+    };
+
+    // The device ignores kNoInterrupt when event indexes are in use. Instead
+    // the used event index is kept half the index space ahead of the buffers
+    // we have seen, where the device cannot reach it. The packed ring has a
+    // disable flag which works either way.
+    void SuppressUsedEvent() {
+      if (packed_)
+        return;
+      used_event_->store(last_used_ + 0x8000, std::memory_order_relaxed);
+    }
+
+    bool UseIndirect(size_t len) const {
+      return (indirect_ || packed_indirect_) && len > 1 && len <= kMaxIndirect;
+    }
+
+    // Flags which make a packed descriptor available in the current lap
+    uint16_t PackedAvailFlags() const {
+      return avail_wrap_ ? PackedDesc::Avail : PackedDesc::Used;
+    }
+
+    void AdvancePackedAvail() {
+      if (++next_avail_ == qsize_) {
+        next_avail_ = 0;
+        avail_wrap_ = !avail_wrap_;
+      }
+    }
+
+    // Write the chain to the next free descriptors of the packed ring. The
+    // device may see the head descriptor as soon as its flags are written,
+    // so they are written last.
+    void AddPacked(std::unique_ptr<IOBuf> bufs, size_t len, size_t out_num) {
+      auto id = free_head_;
+      free_head_ = id_next_[id];
+      auto& head = packed_desc_[next_avail_];
+      uint16_t head_flags = 0;
+      uint16_t descs;
+      if (UseIndirect(len)) {
+        auto table = &packed_indirect_[id * kMaxIndirect];
+        size_t i = 0;
+        for (const auto& buf : *bufs) {
+          auto& desc = table[i++];
+          kassert(vmem::IdentityMapped(buf.Data()));
+          desc.addr = reinterpret_cast<uint64_t>(buf.Data());
+          desc.len = buf.Length();
+          uint16_t flags = 0;
+          if (out_num == 0) {
+            flags = PackedDesc::Write;
+          } else {
+            --out_num;
+          }
+          desc.flags.store(flags, std::memory_order_relaxed);
+        }
+
+        head.addr = reinterpret_cast<uint64_t>(table);
+        head.len = len * sizeof(PackedDesc);
+        head.id = id;
+        head_flags = PackedDesc::Indirect | PackedAvailFlags();
+        AdvancePackedAvail();
+        descs = 1;
+      } else {
+        size_t i = 0;
+        for (const auto& buf : *bufs) {
+          auto& desc = packed_desc_[next_avail_];
+          kassert(vmem::IdentityMapped(buf.Data()));
+          desc.addr = reinterpret_cast<uint64_t>(buf.Data());
+          desc.len = buf.Length();
+          desc.id = id;
+          uint16_t flags = PackedAvailFlags();
+          if (++i < len)
+            flags |= PackedDesc::Next;
+          if (out_num == 0) {
+            flags |= PackedDesc::Write;
+          } else {
+            --out_num;
+          }
+          if (&desc == &head) {
+            head_flags = flags;
+          } else {
+            desc.flags.store(flags, std::memory_order_relaxed);
+          }
+          AdvancePackedAvail();
+        }
+        descs = len;
+      }
+
+      id_descs_[id] = descs;
+      free_count_ -= descs;
+      avail_idx_ += descs;
+      buf_references_[id] = std::move(bufs);
+
+      // the rest of the chain must be visible before the head is made
+      // available
+      head.flags.store(head_flags, std::memory_order_release);
+    }
+
+    // Whether the device asked to be notified of the descriptors added to the
+    // packed ring since it was last considered
+    bool PackedNeedsKick() {
+      // Read both fields at once, the device may be updating them
+      auto event = reinterpret_cast<volatile std::atomic<uint32_t>*>(
+                       device_event_)->load(std::memory_order_relaxed);
+      uint16_t off_wrap = event;
+      uint16_t flags = event >> 16;
+      if (flags != EventSuppress::kDesc)
+        return flags != EventSuppress::kDisable;
+
+      // ring positions are compared as in the split ring, an event in the
+      // previous lap is made to sit below the current positions
+      uint16_t event_idx = off_wrap & 0x7fff;
+      if (static_cast<bool>(off_wrap >> 15) != avail_wrap_)
+        event_idx -= qsize_;
+      uint16_t old = next_avail_ - (uint16_t)(avail_idx_ - notified_idx_);
+      return (uint16_t)(next_avail_ - event_idx - 1) <
+             (uint16_t)(next_avail_ - old);
+    }
+
+    // Take the next used buffer off the ring and free its descriptors. Only
+    // call if HasUsedBuffer() returned true.
+    std::unique_ptr<IOBuf> PopUsed(uint32_t& len) {
+      uint16_t id;
+      uint16_t descs;
+      if (packed_) {
+        auto& desc = packed_desc_[last_used_];
+        id = desc.id;
+        len = desc.len;
+        descs = id_descs_[id];
+        last_used_ += descs;
+        if (last_used_ >= qsize_) {
+          last_used_ -= qsize_;
+          used_wrap_ = !used_wrap_;
+        }
+        id_next_[id] = free_head_;
+      } else {
+        auto& elem = used_->ring[last_used_ % qsize_];
+        id = elem.id;
+        len = elem.len;
+        Desc* descriptor = &desc_[id];
+        descs = 1;
+        while (descriptor->flags & Desc::Next) {
+          ++descs;
+          descriptor = &desc_[descriptor->next];
+        }
+        descriptor->next = free_head_;
+        ++last_used_;
+      }
+      free_head_ = id;
+      free_count_ += descs;
+      kassert(buf_references_[id]);
+      return std::move(buf_references_[id]);
+    }
+
+    // trim the buffer chain to only include the actual size
+    static void TrimChain(IOBuf& buf, uint32_t len) {
+      auto packet_len = len;
+      for (auto& b : buf) {
+        auto blen = b.Length();
+        if (blen > packet_len) {
+          b.TrimEnd(blen - packet_len);
+          packet_len = 0;
+        } else {
+          packet_len -= blen;
+        }
+      }
+
+      kassert(buf.ComputeChainDataLength() == len);
+    }
+
+    // The device reads the tables by physical address, so like the ring they
+    // come from the page allocator rather than the heap
+    template <typename T> T* AllocIndirect() {
+      auto sz = align::Up(sizeof(T) * qsize_ * kMaxIndirect, 4096);
+      auto order = Fls(sz - 1) - pmem::kPageShift + 1;
+      auto page = page_allocator->Alloc(order, nid_);
+      kbugon(page == Pfn::None(), "virtio: page allocation failed");
+      auto table = reinterpret_cast<T*>(page.ToAddr());
+      memset(static_cast<void*>(table), 0, sz);
+      return table;
+    }
+
     VirtioDriver<VirtType>& driver_;
     size_t idx_;
+    Nid nid_;
     void* addr_;
     Desc* desc_;
     Avail* avail_;
     Used* used_;
     volatile std::atomic<uint16_t>* avail_event_;
     volatile std::atomic<uint16_t>* used_event_;
+    PackedDesc* packed_desc_;
+    EventSuppress* driver_event_;
+    EventSuppress* device_event_;
     uint16_t qsize_;
+    // next used element, in the packed ring its position
     uint16_t last_used_;
+    // descriptor chains (split) or descriptors (packed) made available
     uint16_t avail_idx_;
+    // avail_idx_ when the device was last considered for notification
+    uint16_t notified_idx_;
     uint16_t used_head_;
+    // first free descriptor, in the packed ring the first free buffer id
     uint16_t free_head_;
     uint16_t free_count_;
+    // packed ring position where the next descriptor is made available
+    uint16_t next_avail_;
+    bool avail_wrap_;
+    bool used_wrap_;
     std::vector<std::unique_ptr<IOBuf>> buf_references_;
+    // packed ring free id list and the descriptors each id takes in the ring
+    std::vector<uint16_t> id_next_;
+    std::vector<uint16_t> id_descs_;
+    // kMaxIndirect descriptors for each descriptor in the ring
+    Desc* indirect_{nullptr};
+    // kMaxIndirect descriptors for each packed ring buffer id
+    PackedDesc* packed_indirect_{nullptr};
+    bool packed_;
     bool event_indexes_;
     bool interrupts_;
+    uint64_t kicks_{0};
   };
 
-  explicit VirtioDriver(pci::Device& dev) : dev_(dev), bar0_(dev.GetBar(0)) {
+  explicit VirtioDriver(pci::Device& dev) : dev_(dev) {
     dev_.SetBusMaster(true);
     auto msix = dev_.MsixEnable();
     kbugon(!msix, "Virtio without msix is unsupported\n");
 
+    // Transitional devices offer both transports, the modern one is needed
+    // for feature bits beyond 31
+    modern_ = FindModernRegions();
+    if (!modern_)
+      bar0_ = &dev_.GetBar(0);
+
     Reset();
 
     AddDeviceStatus(kConfigAcknowledge | kConfigDriver);
@@ -389,26 +760,53 @@ template <typename VirtType> class VirtioDriver {
     SetDeviceStatus(s);
   }
 
-  void Kick(size_t idx) { ConfigWrite16(kQueueNotify, idx); }
+  void Kick(size_t idx) {
+    if (modern_) {
+      notify_.bar->Write16(notify_offsets_[idx], idx);
+    } else {
+      ConfigWrite16(kQueueNotify, idx);
+    }
+  }
 
   uint8_t DeviceConfigRead8(size_t idx) {
+    if (modern_)
+      return device_.bar->Read8(device_.offset + idx);
     return ConfigRead8(kDeviceConfiguration + idx);
   }
 
   uint16_t DeviceConfigRead16(size_t idx) {
+    if (modern_)
+      return device_.bar->Read16(device_.offset + idx);
     return ConfigRead16(kDeviceConfiguration + idx);
   }
 
-  uint32_t GetDeviceFeatures() { return ConfigRead32(kDeviceFeatures); }
+  uint64_t GetDeviceFeatures() {
+    if (!modern_)
+      return ConfigRead32(kDeviceFeatures);
 
-  uint32_t GetGuestFeatures() { return ConfigRead32(kGuestFeatures); }
+    CommonWrite32(kCommonDeviceFeatureSelect, 0);
+    uint64_t features = CommonRead32(kCommonDeviceFeature);
+    CommonWrite32(kCommonDeviceFeatureSelect, 1);
+    features |= static_cast<uint64_t>(CommonRead32(kCommonDeviceFeature))
+                << 32;
+    return features;
+  }
 
-  uint32_t SetupFeatures() {
+  uint64_t SetupFeatures() {
     auto device_features = GetDeviceFeatures();
-    kprintf("Device features: %x\n", device_features);
+    kprintf("Device features: %" PRIx64 "\n", device_features);
     auto driver_features = VirtType::GetDriverFeatures();
+    // the modern transport requires the device to be driven as a 1.0 device
+    if (modern_)
+      driver_features |= 1ull << kVirtioVersion1;
     auto subset = device_features & driver_features;
     SetGuestFeatures(subset);
+    features_ = subset;
+    if (modern_) {
+      AddDeviceStatus(kConfigFeaturesOk);
+      kbugon(!(GetDeviceStatus() & kConfigFeaturesOk),
+             "virtio: device rejected features\n");
+    }
     return subset;
   }
 
@@ -417,61 +815,199 @@ template <typename VirtType> class VirtioDriver {
     auto qsize = GetQueueSize();
     kassert(qsize != 0);
 
-    queues_[idx].reset(new VRing(*this, qsize, idx, nid));
-    SetQueueAddr(queues_[idx]->addr());
+    auto packed = features_ & (1ull << kVirtioRingPacked);
+    queues_[idx].reset(new VRing(*this, qsize, idx, nid, packed));
+    if (features_ & (1 << kVirtioRingEventIdx))
+      queues_[idx]->EnableEventIndexes();
+    SetQueueAddr(*queues_[idx]);
     SetQueueVector(idx);
+    if (modern_) {
+      notify_offsets_[idx] =
+          notify_.offset +
+          CommonRead16(kCommonQueueNotifyOff) * notify_multiplier_;
+      CommonWrite16(kCommonQueueEnable, 1);
+    }
 
     return *queues_[idx];
   }
 
-  void SetNumQueues(size_t nqueues) { queues_.resize(nqueues); }
+  void SetNumQueues(size_t nqueues) {
+    queues_.resize(nqueues);
+    notify_offsets_.resize(nqueues);
+  }
 
  private:
-  uint8_t ConfigRead8(size_t offset) { return bar0_.Read8(offset); }
+  // A group of modern transport registers
+  struct Region {
+    pci::Bar* bar{nullptr};
+    size_t offset{0};
+  };
+
+  // Find the modern transport's registers, returns false if the device only
+  // has the legacy interface
+  bool FindModernRegions() {
+    for (auto cap : dev_.FindCapabilities(kPciCapVendor)) {
+      auto bar = dev_.Read8(cap + kPciCapBar);
+      if (bar > 5)
+        continue;
+
+      Region region;
+      region.bar = &dev_.GetBar(bar);
+      region.offset = dev_.Read32(cap + kPciCapOffset);
+      // The first capability of each type is the preferred one
+      switch (dev_.Read8(cap + kPciCapCfgType)) {
+      case kPciCapCommonCfg:
+        if (!common_.bar)
+          common_ = region;
+        break;
+      case kPciCapNotifyCfg:
+        if (!notify_.bar) {
+          notify_ = region;
+          notify_multiplier_ = dev_.Read32(cap + kPciCapNotifyMultiplier);
+        }
+        break;
+      case kPciCapDeviceCfg:
+        if (!device_.bar)
+          device_ = region;
+        break;
+      }
+    }
+
+    if (!common_.bar || !notify_.bar || !device_.bar)
+      return false;
+
+    common_.bar->Map();
+    notify_.bar->Map();
+    device_.bar->Map();
+    return true;
+  }
+
+  uint8_t ConfigRead8(size_t offset) { return bar0_->Read8(offset); }
 
-  uint16_t ConfigRead16(size_t offset) { return bar0_.Read16(offset); }
+  uint16_t ConfigRead16(size_t offset) { return bar0_->Read16(offset); }
 
-  uint32_t ConfigRead32(size_t offset) { return bar0_.Read32(offset); }
+  uint32_t ConfigRead32(size_t offset) { return bar0_->Read32(offset); }
 
   void ConfigWrite8(size_t offset, uint8_t value) {
-    bar0_.Write8(offset, value);
+    bar0_->Write8(offset, value);
   }
 
   void ConfigWrite16(size_t offset, uint16_t value) {
-    bar0_.Write16(offset, value);
+    bar0_->Write16(offset, value);
   }
 
   void ConfigWrite32(size_t offset, uint32_t value) {
-    bar0_.Write32(offset, value);
+    bar0_->Write32(offset, value);
+  }
+
+  uint8_t CommonRead8(size_t offset) {
+    return common_.bar->Read8(common_.offset + offset);
+  }
+
+  uint16_t CommonRead16(size_t offset) {
+    return common_.bar->Read16(common_.offset + offset);
+  }
+
+  uint32_t CommonRead32(size_t offset) {
+    return common_.bar->Read32(common_.offset + offset);
+  }
+
+  void CommonWrite8(size_t offset, uint8_t value) {
+    common_.bar->Write8(common_.offset + offset, value);
+  }
+
+  void CommonWrite16(size_t offset, uint16_t value) {
+    common_.bar->Write16(common_.offset + offset, value);
+  }
+
+  void CommonWrite32(size_t offset, uint32_t value) {
+    common_.bar->Write32(common_.offset + offset, value);
+  }
+
+  // 64 bit registers are written as two halves
+  void CommonWrite64(size_t offset, void* addr) {
+    auto val = reinterpret_cast<uintptr_t>(addr);
+    CommonWrite32(offset, val);
+    CommonWrite32(offset + 4, val >> 32);
   }
 
   void Reset() { SetDeviceStatus(0); }
 
-  uint8_t GetDeviceStatus() { return ConfigRead8(kDeviceStatus); }
+  uint8_t GetDeviceStatus() {
+    if (modern_)
+      return CommonRead8(kCommonDeviceStatus);
+    return ConfigRead8(kDeviceStatus);
+  }
+
+  void SetDeviceStatus(uint8_t status) {
+    if (modern_) {
+      CommonWrite8(kCommonDeviceStatus, status);
+    } else {
+      ConfigWrite8(kDeviceStatus, status);
+    }
+  }
 
-  void SetDeviceStatus(uint8_t status) { ConfigWrite8(kDeviceStatus, status); }
+  void SelectQueue(uint16_t queue) {
+    if (modern_) {
+      CommonWrite16(kCommonQueueSelect, queue);
+    } else {
+      ConfigWrite16(kQueueSelect, queue);
+    }
+  }
 
-  void SelectQueue(uint16_t queue) { ConfigWrite16(kQueueSelect, queue); }
+  uint16_t GetQueueSize() {
+    if (modern_)
+      return CommonRead16(kCommonQueueSize);
+    return ConfigRead16(kQueueSize);
+  }
 
-  uint16_t GetQueueSize() { return ConfigRead16(kQueueSize); }
+  void SetQueueAddr(VRing& queue) {
+    if (modern_) {
+      CommonWrite64(kCommonQueueDesc, queue.desc_addr());
+      CommonWrite64(kCommonQueueDriver, queue.driver_addr());
+      CommonWrite64(kCommonQueueDevice, queue.device_addr());
+      return;
+    }
 
-  void SetQueueAddr(void* addr) {
-    auto addr_val = reinterpret_cast<uintptr_t>(addr);
+    auto addr_val = reinterpret_cast<uintptr_t>(queue.addr());
     addr_val >>= kQueueAddressShift;
     kassert(addr_val <= std::numeric_limits<uint32_t>::max());
     ConfigWrite32(kQueueAddress, addr_val);
   }
 
-  void SetQueueVector(uint16_t index) { ConfigWrite16(kQueueVector, index); }
+  void SetQueueVector(uint16_t index) {
+    if (modern_) {
+      CommonWrite16(kCommonQueueVector, index);
+    } else {
+      ConfigWrite16(kQueueVector, index);
+    }
+  }
+
+  void SetGuestFeatures(uint64_t features) {
+    if (!modern_) {
+      ConfigWrite32(kGuestFeatures, features);
+      return;
+    }
 
-  void SetGuestFeatures(uint32_t features) {
-    ConfigWrite32(kGuestFeatures, features);
+    CommonWrite32(kCommonDriverFeatureSelect, 0);
+    CommonWrite32(kCommonDriverFeature, features);
+    CommonWrite32(kCommonDriverFeatureSelect, 1);
+    CommonWrite32(kCommonDriverFeature, features >> 32);
   }
 
   pci::Device& dev_;
-  pci::Bar& bar0_;
+  // legacy registers, null if the modern transport is used
+  pci::Bar* bar0_{nullptr};
+  Region common_;
+  Region notify_;
+  Region device_;
+  uint32_t notify_multiplier_{0};
+  // offset in notify_.bar written to notify each queue
+  std::vector<size_t> notify_offsets_;
+  bool modern_{false};
 
   std::vector<std::unique_ptr<VRing>> queues_;
+  uint64_t features_{0};
 };
 }  // namespace ebbrt
 
@@ -5,8 +5,17 @@
 #ifndef BAREMETAL_SRC_INCLUDE_EBBRT_VIRTIONET_H_
 #define BAREMETAL_SRC_INCLUDE_EBBRT_VIRTIONET_H_
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+
+#include <ebbrt/CacheAligned.h>
+#include <ebbrt/Clock.h>
+#include <ebbrt/Cpu.h>
 #include <ebbrt/MulticoreEbb.h>
 #include <ebbrt/Net.h>
+#include <ebbrt/NetGro.h>
 #include <ebbrt/SlabAllocator.h>
 #include <ebbrt/SpinLock.h>
 #include <ebbrt/Virtio.h>
@@ -18,12 +27,40 @@ class VirtioNetDriver : public VirtioDriver<VirtioNetDriver>,
                         public EthernetDevice {
  public:
   static const constexpr uint16_t kDeviceId = 0x1000;
+  // id of a device without the legacy interface
+  static const constexpr uint16_t kModernDeviceId = 0x1041;
 
   explicit VirtioNetDriver(pci::Device& dev);
 
+  // How a receive queue waits for packets
+  struct PollConfig {
+    enum Mode : uint8_t {
+      // poll until the queue is empty, then re-arm the interrupt
+      kInterrupt,
+      // poll forever, never take an interrupt
+      kPoll,
+      // a poll receiving at least busy_packets keeps the queue polling, until
+      // nothing is received for idle_timeout
+      kAdaptive
+    };
+
+    Mode mode;
+    size_t busy_packets;
+    std::chrono::microseconds idle_timeout;
+  };
+
+  static const constexpr size_t kAllQueues = Cpu::kMaxCpus;
+
   static void Create(pci::Device& dev);
-  static uint32_t GetDriverFeatures();
-  void Send(std::unique_ptr<IOBuf> buf, PacketInfo pinfo) override;
+  static uint64_t GetDriverFeatures();
+  // Applies to receive queue queue, or to every receive queue, from its next
+  // poll on. Safe to call from any core at any time.
+  static void SetPollConfig(const PollConfig& config,
+                            size_t queue = kAllQueues);
+  static PollConfig GetPollConfig(size_t queue);
+  void Send(std::unique_ptr<MutIOBuf> buf, PacketInfo pinfo) override;
+  bool SendCongested() override;
+  void SendFlush() override;
   const EthernetAddress& GetMacAddress() override;
 
  private:
@@ -32,26 +69,108 @@ class VirtioNetDriver : public VirtioDriver<VirtioNetDriver>,
   void ReceivePoll();
   void Start();
 
+  // Packets waiting for room in a send queue, in the order they were sent
+  struct alignas(cache_size) TxBacklog : CacheAligned {
+    SpinLock lock;
+    std::deque<std::pair<std::unique_ptr<MutIOBuf>, PacketInfo>> packets;
+    // set when the backlog reaches its high watermark, cleared once it drains
+    // to the low one. Read without the lock.
+    std::atomic_bool congested{false};
+  };
+
+  static const PollConfig& PollConfigOf(size_t queue);
+
+  // Constant initialized, polling starts before any constructors run
+  static const PollConfig kDefaultPollConfig;
+  // The configuration set for all queues, shared by every queue without one
+  // of its own. Null until set, meaning kDefaultPollConfig.
+  static std::atomic<const PollConfig*> shared_poll_config_;
+  // Each queue's own configuration, published for its polling core to pick
+  // up. Null until set, meaning the shared one. Replaced configurations are
+  // freed after an rcu grace period, as a poll may still be reading them.
+  static std::array<std::atomic<const PollConfig*>, Cpu::kMaxCpus>
+      poll_configs_;
+
   EbbRef<VirtioNetRep> ebb_;
   EthernetAddress mac_addr_;
   NetworkManager::Interface& itf_;
   VRing* ctrl_queue_;
+  // Queue pair i is owned by core i. With fewer pairs than cores, the send
+  // queues are shared behind their backlog's lock and received packets are
+  // steered to the other cores.
+  size_t num_queue_pairs_;
+  std::vector<std::unique_ptr<TxBacklog>> tx_backlogs_;
 
   friend class VirtioNetRep;
 };
 
 class VirtioNetRep : public MulticoreEbb<VirtioNetRep, VirtioNetDriver> {
  public:
+  // Maximum number of receive buffers processed per poll
+  static const constexpr size_t kRxBudget = 64;
+  // Maximum number of packets waiting for room in a send queue, beyond which
+  // they are dropped
+  static const constexpr size_t kTxBacklog = 512;
+  // Backlog depths at which senders are told the queue is congested, and
+  // told it no longer is. The gap keeps the device busy while they resume.
+  static const constexpr size_t kTxBacklogHigh = kTxBacklog / 2;
+  static const constexpr size_t kTxBacklogLow = kTxBacklog / 8;
+
+  struct RxStats {
+    uint64_t packets{0};
+    // malformed packets which were dropped
+    uint64_t dropped{0};
+    // polls which used their whole budget
+    uint64_t budget_exhausted{0};
+    // packets steered to another core
+    uint64_t steered{0};
+    // adaptive switches from interrupts to polling and back
+    uint64_t to_poll{0};
+    uint64_t to_interrupt{0};
+  };
+
+  struct TxStats {
+    uint64_t packets{0};
+    uint64_t bytes{0};
+    // device notifications, each one is a VM exit
+    uint64_t notifications{0};
+    // packets which found the send queue full and waited in the backlog
+    uint64_t backlogged{0};
+    // packets dropped because the backlog was full
+    uint64_t dropped{0};
+    // deepest the backlog has been
+    uint64_t backlog_max{0};
+    // times the backlog reached its high watermark
+    uint64_t congested{0};
+  };
+
+  // A received packet and what the device told us about it
+  typedef std::pair<std::unique_ptr<MutIOBuf>, RxInfo> RxPacket;
+
   explicit VirtioNetRep(const VirtioNetDriver& root);
-  void Send(std::unique_ptr<IOBuf> buf, PacketInfo pinfo);
+  void Send(std::unique_ptr<MutIOBuf> buf, PacketInfo pinfo);
+  bool SendCongested();
+  void SendFlush();
+  // Send queue interrupt, taken while packets are backlogged
+  void SendComplete();
   void Receive();
+  // Receive packets steered to this core by the core owning the receive queue
+  void ReceiveSteered(std::vector<RxPacket> batch);
+  const RxStats& GetRxStats() const { return rx_stats_; }
+  TxStats GetTxStats() const;
 
  private:
   void FillRxRing();
   void ReceivePoll();
+  void ReceiveBuffer(std::unique_ptr<MutIOBuf> buf);
+  void SteerBatch();
+  void BacklogSend(std::unique_ptr<MutIOBuf> buf, PacketInfo pinfo);
+  void DrainBacklog();
+  void QueueSend(std::unique_ptr<MutIOBuf> buf, PacketInfo pinfo);
 
   struct VirtioNetHeader {
     static const constexpr uint8_t kNeedsCsum = 1;
+    static const constexpr uint8_t kDataValid = 2;
     static const constexpr uint8_t kGsoNone = 0;
     static const constexpr uint8_t kGsoTcpv4 = 1;
     static const constexpr uint8_t kGsoUdp = 3;
@@ -68,12 +187,28 @@ class VirtioNetRep : public MulticoreEbb<VirtioNetRep, VirtioNetDriver> {
   };
 
   const VirtioNetDriver& root_;
-  VirtioDriver<VirtioNetDriver>::VRing& rcv_queue_;
+  // null on cores without a queue pair of their own
+  VirtioDriver<VirtioNetDriver>::VRing* rcv_queue_;
   VirtioDriver<VirtioNetDriver>::VRing& snd_queue_;
+  VirtioNetDriver::TxBacklog& snd_backlog_;
+  // held around snd_queue_ and snd_backlog_ if they are shared, otherwise null
+  SpinLock* snd_lock_;
   EventManager::IdleCallback receive_callback_;
-  size_t circ_buffer_head_;
-  size_t circ_buffer_tail_;
-  std::array<std::unique_ptr<MutIOBuf>, 256> circ_buffer_;
+  // whether an adaptive queue is polling with its interrupt disabled, and
+  // when it last received packets
+  bool rx_polling_;
+  clock::Wall::time_point rx_last_busy_;
+  // packet being reassembled from mergeable receive buffers
+  std::unique_ptr<MutIOBuf> rx_partial_;
+  RxInfo rx_partial_info_;
+  uint16_t rx_partial_remaining_;
+  // packets received in the current poll
+  std::vector<RxPacket> rx_batch_;
+  // packets of the current poll to be handed to each core
+  std::vector<std::vector<RxPacket>> steer_batches_;
+  GenericReceiveOffload gro_;
+  RxStats rx_stats_;
+  TxStats tx_stats_;
 };
 }  // namespace ebbrt
 
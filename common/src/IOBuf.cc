@@ -7,8 +7,7 @@
 #include <cstdlib>
 
 ebbrt::IOBuf::IOBuf(const uint8_t* data, size_t length) noexcept
-    : data_(data),
-      length_(length) {}
+    : data_(data), length_(length), chain_length_(length) {}
 
 ebbrt::IOBuf::~IOBuf() noexcept {
   while (Next() != this) {
@@ -19,9 +18,12 @@ ebbrt::IOBuf::~IOBuf() noexcept {
 
 void ebbrt::IOBuf::AdvanceChain(size_t amount) {
   assert(ComputeChainDataLength() >= amount);
+  // The head's total is updated once rather than by each element
+  Head()->chain_length_ -= amount;
   for (auto& buf : *this) {
     auto advance_len = std::min(buf.Length(), amount);
-    buf.Advance(advance_len);
+    buf.data_ += advance_len;
+    buf.length_ -= advance_len;
     amount -= advance_len;
     if (amount == 0)
       break;
@@ -35,6 +37,13 @@ void ebbrt::IOBuf::PrependChain(std::unique_ptr<IOBuf> iobuf) {
   // Remember the tail of the other chain
   auto other_tail = other->prev_;
 
+  // Account for the other chain on our head, its own head stops being one
+  auto head = Head();
+  auto other_head = other->Head();
+  head->chain_length_ += other_head->chain_length_;
+  head->chain_elements_ += other_head->chain_elements_;
+  other_head->is_head_ = false;
+
   // Attach other
   prev_->next_ = other;
   other->prev_ = prev_;
@@ -44,20 +53,15 @@ void ebbrt::IOBuf::PrependChain(std::unique_ptr<IOBuf> iobuf) {
   prev_ = other_tail;
 }
 
-size_t ebbrt::IOBuf::CountChainElements() const {
-  size_t elements = 1;
-  for (auto current = next_; current != this; current = current->next_) {
-    ++elements;
-  }
-  return elements;
-}
-
-size_t ebbrt::IOBuf::ComputeChainDataLength() const {
-  auto len = length_;
+void ebbrt::IOBuf::MakeHead() {
+  is_head_ = true;
+  chain_length_ = length_;
+  chain_elements_ = 1;
   for (auto current = next_; current != this; current = current->next_) {
-    len += current->length_;
+    current->is_head_ = false;
+    chain_length_ += current->length_;
+    ++chain_elements_;
   }
-  return len;
 }
 
 ebbrt::IOBuf::ConstIterator ebbrt::IOBuf::cbegin() const {
@@ -34,3 +34,11 @@ ebbrt::MakeUniqueIOBuf(size_t capacity, bool zero_memory) {
 
   return std::unique_ptr<MutUniqueIOBuf>(new (b) MutUniqueIOBuf(buf, capacity));
 }
+
+std::unique_ptr<ebbrt::MutUniqueIOBuf>
+ebbrt::MakeUniqueIOBufWithHeadroom(size_t headroom, size_t length,
+                                   bool zero_memory) {
+  auto buf = MakeUniqueIOBuf(headroom + length, zero_memory);
+  buf->Advance(headroom);
+  return buf;
+}
@@ -41,17 +41,19 @@ class IOBufMessageReader : public capnp::MessageReader {
                      capnp::ReaderOptions options = capnp::ReaderOptions())
       : capnp::MessageReader(options), buf_(std::move(buf)),
         dp_(buf_->GetDataPointer()) {
-    auto nseg = dp_.Get<uint32_t>() + 1;
+    // The header is only needed here, so copy it out rather than having the
+    // data pointer make it contiguous
+    auto nseg = dp_.CopyOut<uint32_t>() + 1;
     uint32_t seg_sizes[nseg];  // NOLINT
-    for (uint32_t i = 0; i < nseg; ++i) {
-      seg_sizes[i] = dp_.Get<uint32_t>();
-    }
+    dp_.CopyOut(seg_sizes, nseg * sizeof(uint32_t));
     if (nseg % 2 == 0)
       dp_.Advance(4);
 
     segments_.reserve(nseg);
     for (uint32_t i = 0; i < nseg; ++i) {
       auto size = seg_sizes[i];
+      // capnp needs each segment to be contiguous, a segment which lies
+      // within one buffer is used in place and only straddling ones are copied
       auto data = dp_.Get(size * sizeof(capnp::word));
       segments_.emplace_back(reinterpret_cast<const capnp::word*>(data), size);
     }
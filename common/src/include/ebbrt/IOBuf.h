@@ -7,12 +7,16 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <forward_list>
 #include <memory>
 #include <vector>
 
 #include <boost/iterator/iterator_facade.hpp>
 
+#include <ebbrt/Align.h>
+#include <ebbrt/Compiler.h>
+
 namespace ebbrt {
 class IOBuf {
  public:
@@ -42,6 +46,12 @@ class IOBuf {
 
   const uint8_t* BufferEnd() const { return Buffer() + Capacity(); }
 
+  // Space in front of the data which can be reclaimed with Retreat
+  size_t Headroom() const { return Data() - Buffer(); }
+
+  // Space after the data which is not in use
+  size_t Tailroom() const { return BufferEnd() - Tail(); }
+
   IOBuf* Next() { return next_; }
 
   const IOBuf* Next() const { return next_; }
@@ -54,21 +64,28 @@ class IOBuf {
     assert(length_ >= amount);
     data_ += amount;
     length_ -= amount;
+    Head()->chain_length_ -= amount;
   }
 
   void Retreat(size_t amount) {
     assert((data_ - amount) >= Buffer());
     data_ -= amount;
     length_ += amount;
+    Head()->chain_length_ += amount;
   }
 
-  void TrimEnd(size_t amount) { length_ -= amount; }
+  void TrimEnd(size_t amount) {
+    length_ -= amount;
+    Head()->chain_length_ -= amount;
+  }
 
-  bool IsChained() const { return Next() != this; }
+  bool IsChained() const { return next_ != this; }
 
-  size_t CountChainElements() const;
+  // The totals are kept on the head of the chain, so these are O(1) from the
+  // head and from the elements next to it
+  size_t CountChainElements() const { return Head()->chain_elements_; }
 
-  size_t ComputeChainDataLength() const;
+  size_t ComputeChainDataLength() const { return Head()->chain_length_; }
 
   void AdvanceChain(size_t amount);
 
@@ -80,6 +97,7 @@ class IOBuf {
   /* Remove this IOBuf from its current chain and return a unique_ptr to it. Do
    * not call on the head of a chain that is owned already */
   std::unique_ptr<IOBuf> Unlink() {
+    LeaveChain();
     next_->prev_ = prev_;
     prev_->next_ = next_;
     prev_ = this;
@@ -99,6 +117,11 @@ class IOBuf {
     prev_ = new_end;
     new_end->next_ = this;
 
+    end.MakeHead();
+    auto head = Head();
+    head->chain_length_ -= end.chain_length_;
+    head->chain_elements_ -= end.chain_elements_;
+
     return std::unique_ptr<IOBuf>(&end);
   }
 
@@ -106,6 +129,7 @@ class IOBuf {
      IOBuf that formerly followed it in the chain */
   std::unique_ptr<IOBuf> Pop() {
     IOBuf* next = next_;
+    LeaveChain();
     next_->prev_ = prev_;
     prev_->next_ = next_;
     prev_ = this;
@@ -122,8 +146,58 @@ class IOBuf {
   ConstIterator begin() const;
   ConstIterator end() const;
 
+  // A run of bytes in a chain which may span several buffers. Nothing is
+  // copied, the view is only valid as long as the chain is not modified.
+  class ScatterView {
+   public:
+    ScatterView(const IOBuf* p, size_t offset, size_t length)
+        : p_(p), offset_(offset), length_(length) {}
+
+    size_t Length() const { return length_; }
+
+    bool IsContiguous() const { return p_->Length() - offset_ >= length_; }
+
+    // Only valid if the view is contiguous
+    const uint8_t* Data() const {
+      assert(IsContiguous());
+      return p_->Data() + offset_;
+    }
+
+    // Call f(data, len) on each contiguous piece of the view in order
+    template <typename F> void ForEachSegment(F&& f) const {
+      auto p = p_;
+      auto len = length_;
+      auto offset = offset_;
+      while (len > 0) {
+        auto remainder = std::min(p->Length() - offset, len);
+        if (remainder > 0)
+          f(p->Data() + offset, remainder);
+        p = p->Next();
+        offset = 0;
+        len -= remainder;
+      }
+    }
+
+    void CopyTo(void* dst) const {
+      auto out = static_cast<uint8_t*>(dst);
+      ForEachSegment([&out](const uint8_t* data, size_t len) {
+        memcpy(out, data, len);
+        out += len;
+      });
+    }
+
+   private:
+    const IOBuf* p_;
+    size_t offset_;
+    size_t length_;
+  };
+
   class DataPointer {
    public:
+    // Straddling requests are packed into chunks of at least this size, so
+    // small ones do not take an allocation each
+    static const constexpr size_t kScratchSize = 64;
+
     explicit DataPointer(const IOBuf* p) : p_{p} {
       assert(p->ComputeChainDataLength() > 0);
       // Iterate past any empty buffers up front
@@ -140,30 +214,35 @@ class IOBuf {
       return p_->Data() + offset_;
     }
 
+    // The result of Get() and GetNoAdvance() points into the chain, unless the
+    // request straddles buffers. It is then copied, and lives as long as the
+    // DataPointer or the one it is moved to. Copying a DataPointer copies such
+    // data, earlier results still point into the original.
     const uint8_t* GetNoAdvance(size_t size) {
       if (!p_)
         throw std::runtime_error("DataPointer::Get(): past end of buffer");
 
       assert(p_->Length() > 0);
       if (p_->Length() - offset_ < size) {
-        // request straddles buffers, allocate a new chunk of memory to copy it
-        // into (so it is contiguous)
-        chunk_list.emplace_front();
-        auto& chunk = chunk_list.front();
-        chunk.reserve(size);
-        auto p = p_;
-        auto len = size;
-        auto offset = offset_;
-        while (len > 0) {
-          auto remainder = std::min(p->Length() - offset, len);
-          auto data = p->Data() + offset;
-          chunk.insert(chunk.end(), data, data + remainder);
-          p = p->Next();
-          offset = 0;
-          len -= remainder;
+        // request straddles buffers, copy it somewhere contiguous. Returned
+        // pointers must stay valid for the life of the DataPointer, so the
+        // copies go to heap chunks which move with it. A chunk is filled up
+        // to its capacity and never grown, growing would move earlier copies.
+        auto view = GetViewNoAdvance(size);
+        auto start = chunk_list.empty()
+                         ? 0
+                         : align::Up(chunk_list.front().size(),
+                                     alignof(uint64_t));
+        if (chunk_list.empty() ||
+            start + size > chunk_list.front().capacity()) {
+          chunk_list.emplace_front();
+          chunk_list.front().reserve(std::max(size, kScratchSize));
+          start = 0;
         }
-
-        return reinterpret_cast<const uint8_t*>(chunk.data());
+        auto& chunk = chunk_list.front();
+        chunk.resize(start + size);
+        view.CopyTo(chunk.data() + start);
+        return reinterpret_cast<const uint8_t*>(chunk.data() + start);
       }
 
       return Data();
@@ -183,6 +262,32 @@ class IOBuf {
       return *reinterpret_cast<const T*>(Get(sizeof(T)));
     }
 
+    ScatterView GetViewNoAdvance(size_t size) {
+      if (!p_)
+        throw std::runtime_error("DataPointer::GetView(): past end of buffer");
+
+      return ScatterView(p_, offset_, size);
+    }
+
+    // Returns the next size bytes without making them contiguous
+    ScatterView GetView(size_t size) {
+      auto ret = GetViewNoAdvance(size);
+      Advance(size);
+      return ret;
+    }
+
+    // Copy the next size bytes into dst
+    void CopyOut(void* dst, size_t size) {
+      GetViewNoAdvance(size).CopyTo(dst);
+      Advance(size);
+    }
+
+    template <typename T> T CopyOut() {
+      T ret;
+      CopyOut(&ret, sizeof(T));
+      return ret;
+    }
+
     void Advance(size_t size) {
       assert(p_->Length() > 0);
       while (size > 0) {
@@ -213,15 +318,65 @@ class IOBuf {
   void SetView(const IOBuf& other) {
     assert(Buffer() == other.Buffer());
     assert(Capacity() == other.Capacity());
+    auto head = Head();
+    head->chain_length_ -= length_;
     data_ = other.Data();
     length_ = other.Length();
+    head->chain_length_ += length_;
   }
 
  private:
+  // Make this the head of its chain and recompute the totals
+  void MakeHead();
+
+  // The elements hold no pointer to the head, which could be left dangling
+  // once it is removed. It is found by walking out from this element in both
+  // directions, which takes one step from either end of the chain.
+  const IOBuf* Head() const {
+    if (likely(is_head_))
+      return this;
+    auto back = prev_;
+    auto fwd = next_;
+    while (!back->is_head_ && !fwd->is_head_) {
+      assert(back != this);
+      back = back->prev_;
+      fwd = fwd->next_;
+    }
+    return back->is_head_ ? back : fwd;
+  }
+
+  IOBuf* Head() {
+    return const_cast<IOBuf*>(static_cast<const IOBuf*>(this)->Head());
+  }
+
+  // Called before this is unlinked. The totals stay on the head, removing the
+  // head hands them to the element after it in O(1).
+  void LeaveChain() {
+    if (next_ == this)
+      return;
+    if (!is_head_) {
+      auto head = Head();
+      head->chain_length_ -= length_;
+      --head->chain_elements_;
+    } else {
+      next_->is_head_ = true;
+      next_->chain_length_ = chain_length_ - length_;
+      next_->chain_elements_ = chain_elements_ - 1;
+    }
+    is_head_ = true;
+    chain_length_ = length_;
+    chain_elements_ = 1;
+  }
+
   IOBuf* next_{this};
   IOBuf* prev_{this};
+  // Exactly one element of a chain is its head, the one holding the totals
+  bool is_head_{true};
   const uint8_t* data_{nullptr};
   size_t length_{0};
+  // Only maintained on the head of a chain
+  size_t chain_length_{0};
+  size_t chain_elements_{1};
 };
 
 class MutIOBuf : public IOBuf {
@@ -241,6 +396,13 @@ class MutIOBuf : public IOBuf {
 
   uint8_t* MutBufferEnd() { return const_cast<uint8_t*>(BufferEnd()); }
 
+  // Grow the data into the headroom and return the new start, so a header can
+  // be written in place
+  uint8_t* Prepend(size_t amount) {
+    Retreat(amount);
+    return MutData();
+  }
+
   MutIOBuf* Next() { return static_cast<MutIOBuf*>(IOBuf::Next()); }
 
   const MutIOBuf* Next() const {
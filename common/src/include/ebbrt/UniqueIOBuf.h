@@ -19,6 +19,12 @@ typedef MutIOBufBase<UniqueIOBufOwner> MutUniqueIOBuf;
 std::unique_ptr<MutUniqueIOBuf> MakeUniqueIOBuf(size_t capacity,
                                                 bool zero_memory = false);
 
+// Allocates length bytes of data preceded by headroom bytes, which lower
+// layers can fill in with MutIOBuf::Prepend
+std::unique_ptr<MutUniqueIOBuf>
+MakeUniqueIOBufWithHeadroom(size_t headroom, size_t length,
+                            bool zero_memory = false);
+
 class UniqueIOBufOwner {
  public:
   const uint8_t* Buffer() const;
@@ -0,0 +1,206 @@
+//          Copyright Boston University SESA Group 2013 - 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Host side test of the IOBuf chain invariants. Random operations are applied
+// to a chain and to a model of it, after each one the links, the order and the
+// totals seen from every element are checked against the model.
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <ebbrt/UniqueIOBuf.h>
+
+namespace {
+const constexpr size_t kCapacity = 64;
+const constexpr size_t kHeadroom = 16;
+
+std::mt19937_64 rng;
+size_t checks;
+
+void Fail(const char* what, int line) {
+  fprintf(stderr, "IOBufChainTest:%d: %s\n", line, what);
+  exit(1);
+}
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond))                                                               \
+      Fail(#cond, __LINE__);                                                   \
+  } while (0)
+
+size_t Random(size_t n) { return rng() % n; }
+
+std::unique_ptr<ebbrt::IOBuf> MakeBuf() {
+  auto buf = ebbrt::MakeUniqueIOBufWithHeadroom(kHeadroom,
+                                                kCapacity - kHeadroom);
+  buf->TrimEnd(Random(kCapacity - kHeadroom));
+  return std::move(buf);
+}
+
+// The chain headed by head must be exactly the elements of model, in order
+void Check(const ebbrt::IOBuf* head, const std::vector<ebbrt::IOBuf*>& model) {
+  ++checks;
+  if (model.empty()) {
+    CHECK(head == nullptr);
+    return;
+  }
+
+  size_t length = 0;
+  for (auto e : model) {
+    length += e->Length();
+  }
+
+  auto e = head;
+  for (size_t i = 0; i < model.size(); ++i) {
+    CHECK(e == model[i]);
+    CHECK(e->Next()->Prev() == e);
+    CHECK(e->CountChainElements() == model.size());
+    CHECK(e->ComputeChainDataLength() == length);
+    e = e->Next();
+  }
+  CHECK(e == head);
+  CHECK(head->IsChained() == (model.size() > 1));
+
+  size_t n = 0;
+  for (auto& buf : *head) {
+    CHECK(&buf == model[n]);
+    ++n;
+  }
+  CHECK(n == model.size());
+}
+
+// Apply a random operation to the chain and the model
+void Step(std::unique_ptr<ebbrt::IOBuf>& head,
+          std::vector<ebbrt::IOBuf*>& model) {
+  if (!head) {
+    head = MakeBuf();
+    model.push_back(head.get());
+    return;
+  }
+
+  auto index = Random(model.size());
+  auto e = head.get();
+  // Only reach elements from the head, as users of a chain do
+  for (size_t i = 0; i < index; ++i) {
+    e = e->Next();
+  }
+
+  switch (Random(8)) {
+  case 0: {
+    // append a short chain
+    auto other = MakeBuf();
+    std::vector<ebbrt::IOBuf*> added = {other.get()};
+    for (size_t i = Random(3); i > 0; --i) {
+      auto b = MakeBuf();
+      added.push_back(b.get());
+      other->PrependChain(std::move(b));
+    }
+    head->PrependChain(std::move(other));
+    model.insert(model.end(), added.begin(), added.end());
+    break;
+  }
+  case 1: {
+    // insert in front of e, which for the head is the end of the chain
+    auto b = MakeBuf();
+    auto p = b.get();
+    e->PrependChain(std::move(b));
+    model.insert(index == 0 ? model.end() : model.begin() + index, p);
+    break;
+  }
+  case 2: {
+    auto rest = head->Pop();
+    model.erase(model.begin());
+    head = std::move(rest);
+    // Elements held from before the pop must still see the chain's totals,
+    // without going through the new head first
+    if (!model.empty()) {
+      auto held = model[Random(model.size())];
+      held->TrimEnd(Random(held->Length() + 1));
+      CHECK(held->CountChainElements() == model.size());
+    }
+    break;
+  }
+  case 3: {
+    if (e == head.get()) {
+      auto rest = head->Pop();
+      head = std::move(rest);
+    } else {
+      e->Unlink();
+    }
+    model.erase(model.begin() + index);
+    break;
+  }
+  case 4: {
+    if (index == 0)
+      break;
+    auto end = head->UnlinkEnd(*e);
+    std::vector<ebbrt::IOBuf*> removed(model.begin() + index, model.end());
+    model.erase(model.begin() + index, model.end());
+    Check(end.get(), removed);
+    break;
+  }
+  case 5:
+    e->Advance(Random(e->Length() + 1));
+    break;
+  case 6:
+    e->Retreat(Random(e->Headroom() + 1));
+    break;
+  case 7:
+    e->TrimEnd(Random(e->Length() + 1));
+    break;
+  }
+}
+
+void RandomChains() {
+  for (size_t round = 0; round < 1000; ++round) {
+    std::unique_ptr<ebbrt::IOBuf> head;
+    std::vector<ebbrt::IOBuf*> model;
+    for (size_t step = 0; step < 200; ++step) {
+      Step(head, model);
+      Check(head.get(), model);
+    }
+  }
+}
+
+// Removing the head of a chain must not walk the rest of it, this takes
+// minutes if it does
+void PopLongChain() {
+  const size_t kElements = 1000000;
+  auto head = MakeBuf();
+  for (size_t i = 1; i < kElements; ++i) {
+    head->PrependChain(MakeBuf());
+  }
+  size_t popped = 0;
+  while (head) {
+    CHECK(head->CountChainElements() == kElements - popped);
+    auto rest = head->Pop();
+    head = std::move(rest);
+    ++popped;
+  }
+  CHECK(popped == kElements);
+}
+
+// Appending a chain must not walk it either
+void PrependLongChain() {
+  const size_t kElements = 1000000;
+  auto head = MakeBuf();
+  for (size_t i = 1; i < kElements; ++i) {
+    auto b = MakeBuf();
+    b->PrependChain(std::move(head));
+    head = std::move(b);
+  }
+  CHECK(head->CountChainElements() == kElements);
+  CHECK(head->Prev()->CountChainElements() == kElements);
+}
+}  // namespace
+
+int main() {
+  RandomChains();
+  PopLongChain();
+  PrependLongChain();
+  printf("IOBufChainTest: %zu checks passed\n", checks);
+  return 0;
+}